@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2014 Przemysław Grzywacz <nexather@gmail.com>
+ * This file is part of xbrzscale.
+ *
+ * xbrzscale is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "animation.h"
+
+#include <SDL2/SDL_image.h>
+#include <SDL2/SDL_rwops.h>
+#include <SDL2/SDL_surface.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <zlib.h>
+
+#include "libxbrzscale.h"
+#include "xbrz/xbrz.h"
+
+namespace {
+
+const unsigned char PNG_SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+uint32_t readU32(const unsigned char* p){
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+uint16_t readU16(const unsigned char* p){
+  return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+void putU32(std::string& s, uint32_t v){
+  s += static_cast<char>(v >> 24);
+  s += static_cast<char>(v >> 16);
+  s += static_cast<char>(v >> 8);
+  s += static_cast<char>(v);
+}
+
+void appendChunk(std::string& png, const char* type, const unsigned char* data, size_t size){
+  const size_t start = png.size();
+  putU32(png, size);
+  png.append(type, 4);
+  png.append(reinterpret_cast<const char*>(data), size);
+  putU32(png, crc32(0, reinterpret_cast<const Bytef*>(png.data() + start + 4), size + 4));
+}
+
+/* APNG frame control (fcTL) */
+struct FrameControl
+{
+  uint32_t w, h, x, y;
+  int delay;
+  unsigned char dispose; // 0 = none, 1 = background, 2 = previous
+  unsigned char blend;   // 0 = source, 1 = over
+};
+
+/* alpha compositing of one straight-alpha ARGB pixel over another, as the APNG spec defines it */
+uint32_t blendOver(uint32_t src, uint32_t dst){
+  const uint32_t sa = src >> 24;
+  if (sa == 0xff) return src;
+  if (sa == 0) return dst;
+
+  const uint32_t u = sa * 255;
+  const uint32_t v = (255 - sa) * (dst >> 24);
+  const uint32_t al = u + v;
+  auto channel = [&](int shift) { return ((((src >> shift) & 0xff) * u + ((dst >> shift) & 0xff) * v) / al) << shift; };
+  return ((al / 255) << 24) | channel(16) | channel(8) | channel(0);
+}
+
+}
+
+bool animation::load(const char* file, Animation& anim){
+  FILE* f = fopen(file, "rb");
+  if (!f) return false;
+
+  std::string data;
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    data.append(buf, n);
+  fclose(f);
+
+  if (data.size() >= 8 && memcmp(data.data(), PNG_SIGNATURE, 8) == 0)
+    return loadAPNG(data, anim);
+  if (data.size() >= 6 && (data.compare(0, 6, "GIF87a") == 0 || data.compare(0, 6, "GIF89a") == 0))
+    return loadGIF(file, anim);
+  return false;
+}
+
+bool animation::loadGIF(const char* file, Animation& anim){
+#if SDL_IMAGE_VERSION_ATLEAST(2, 6, 0)
+  IMG_Animation* gif = IMG_LoadAnimation(file);
+  if (!gif) return false;
+  if (gif->count < 2) {
+    IMG_FreeAnimation(gif);
+    return false;
+  }
+
+  anim.w = gif->w;
+  anim.h = gif->h;
+  anim.loops = 0;
+  anim.frames.resize(gif->count);
+  for (int i = 0; i < gif->count; i++) {
+    uint32_t* pixels = libxbrzscale::surfaceToUint32(gif->frames[i]);
+    if (!pixels) {
+      IMG_FreeAnimation(gif);
+      return false;
+    }
+    anim.frames[i].pixels.assign(pixels, pixels + size_t(anim.w) * anim.h);
+    anim.frames[i].delay = gif->delays[i];
+    delete [] pixels;
+  }
+  IMG_FreeAnimation(gif);
+  return true;
+#else
+  (void)file;
+  (void)anim;
+  return false; // IMG_LoadAnimation() needs SDL_image 2.6
+#endif
+}
+
+bool animation::loadAPNG(const std::string& data, Animation& anim){
+  const unsigned char* const png = reinterpret_cast<const unsigned char*>(data.data());
+  const size_t size = data.size();
+
+  std::string ihdr;         // IHDR payload, width and height are patched per frame
+  std::string sharedChunks; // PLTE, tRNS, gAMA, ...: needed to decode every frame
+  bool animated = false;
+  int numFrames = 0;
+
+  std::vector<FrameControl> controls;
+  std::vector<std::string> frameData; // concatenated IDAT/fdAT payload per fcTL
+  bool seenIdat = false;
+
+  for (size_t pos = 8; pos + 12 <= size;) {
+    const uint32_t len = readU32(png + pos);
+    if (len > size - pos - 12) {
+      fprintf(stderr, "Truncated PNG chunk\n");
+      return false;
+    }
+    const std::string type(reinterpret_cast<const char*>(png + pos + 4), 4);
+    const unsigned char* body = png + pos + 8;
+    pos += 12 + len;
+
+    if (type == "IHDR" && len == 13) {
+      ihdr.assign(reinterpret_cast<const char*>(body), len);
+    } else if (type == "acTL" && len == 8) {
+      animated = true;
+      numFrames = readU32(body);
+      anim.loops = readU32(body + 4);
+    } else if (type == "fcTL" && len == 26) {
+      FrameControl fc;
+      fc.w = readU32(body + 4);
+      fc.h = readU32(body + 8);
+      fc.x = readU32(body + 12);
+      fc.y = readU32(body + 16);
+      const int num = readU16(body + 20);
+      const int den = readU16(body + 22) ? readU16(body + 22) : 100;
+      fc.delay = num * 1000 / den;
+      fc.dispose = body[24];
+      fc.blend = body[25];
+      controls.push_back(fc);
+      frameData.push_back(std::string());
+    } else if (type == "IDAT") {
+      // the default image only belongs to the animation if a fcTL precedes it
+      if (!controls.empty())
+        frameData.back().append(reinterpret_cast<const char*>(body), len);
+      seenIdat = true;
+    } else if (type == "fdAT" && len >= 4) {
+      if (!controls.empty())
+        frameData.back().append(reinterpret_cast<const char*>(body + 4), len - 4);
+    } else if (type == "IEND") {
+      break;
+    } else if (!seenIdat && type != "acTL" && (type == "PLTE" || type == "tRNS" || type == "gAMA" || type == "cHRM" || type == "sRGB" || type == "iCCP" || type == "sBIT")) {
+      appendChunk(sharedChunks, type.c_str(), body, len);
+    }
+  }
+
+  if (!animated || ihdr.empty() || controls.size() < 2)
+    return false;
+  if (numFrames != static_cast<int>(controls.size()))
+    fprintf(stderr, "APNG declares %i frames, found %zu\n", numFrames, controls.size());
+
+  anim.w = readU32(reinterpret_cast<const unsigned char*>(ihdr.data()));
+  anim.h = readU32(reinterpret_cast<const unsigned char*>(ihdr.data()) + 4);
+  if (anim.w <= 0 || anim.h <= 0 || !xbrz::canScale(1, anim.w, anim.h))
+    return false;
+
+  std::vector<uint32_t> canvas(size_t(anim.w) * anim.h, 0);
+  std::vector<uint32_t> saved;
+  anim.frames.clear();
+
+  for (size_t i = 0; i < controls.size(); i++) {
+    FrameControl fc = controls[i];
+    if (fc.w == 0 || fc.h == 0 || fc.x >= static_cast<uint32_t>(anim.w) || fc.y >= static_cast<uint32_t>(anim.h) ||
+        fc.w > static_cast<uint32_t>(anim.w) - fc.x || fc.h > static_cast<uint32_t>(anim.h) - fc.y) {
+      fprintf(stderr, "APNG frame %zu is outside of the canvas\n", i);
+      return false;
+    }
+
+    // decode the frame by handing a standalone PNG to SDL_image
+    std::string framePng(reinterpret_cast<const char*>(PNG_SIGNATURE), 8);
+    std::string frameIhdr;
+    putU32(frameIhdr, fc.w);
+    putU32(frameIhdr, fc.h);
+    frameIhdr += ihdr.substr(8);
+    appendChunk(framePng, "IHDR", reinterpret_cast<const unsigned char*>(frameIhdr.data()), frameIhdr.size());
+    framePng += sharedChunks;
+    appendChunk(framePng, "IDAT", reinterpret_cast<const unsigned char*>(frameData[i].data()), frameData[i].size());
+    appendChunk(framePng, "IEND", NULL, 0);
+
+    SDL_Surface* surface = IMG_Load_RW(SDL_RWFromConstMem(framePng.data(), framePng.size()), 1);
+    if (!surface) {
+      fprintf(stderr, "Failed to decode APNG frame %zu: %s\n", i, IMG_GetError());
+      return false;
+    }
+    uint32_t* pixels = libxbrzscale::surfaceToUint32(surface);
+    SDL_FreeSurface(surface);
+    if (!pixels)
+      return false;
+
+    if (i == 0 && fc.dispose == 2) // nothing to go back to
+      fc.dispose = 1;
+    if (fc.dispose == 2)
+      saved = canvas;
+
+    for (uint32_t y = 0; y < fc.h; y++) {
+      uint32_t* dst = &canvas[size_t(fc.y + y) * anim.w + fc.x];
+      const uint32_t* src = pixels + size_t(y) * fc.w;
+      for (uint32_t x = 0; x < fc.w; x++)
+        dst[x] = fc.blend == 1 ? blendOver(src[x], dst[x]) : src[x];
+    }
+    delete [] pixels;
+
+    AnimationFrame frame;
+    frame.pixels = canvas;
+    frame.delay = fc.delay;
+    anim.frames.push_back(frame);
+
+    // disposal happens before the next frame is rendered
+    if (fc.dispose == 1) {
+      for (uint32_t y = 0; y < fc.h; y++)
+        std::fill_n(&canvas[size_t(fc.y + y) * anim.w + fc.x], fc.w, 0);
+    } else if (fc.dispose == 2) {
+      canvas.swap(saved);
+    }
+  }
+
+  return true;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2014 Przemysław Grzywacz <nexather@gmail.com>
+ * This file is part of xbrzscale.
+ *
+ * xbrzscale is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Multi-frame images. Frames are always complete canvases in xBRZ's ARGB layout: disposal and blending of the
+ * source format have already been applied.
+ */
+struct AnimationFrame
+{
+  std::vector<uint32_t> pixels;
+  int delay; // milliseconds
+};
+
+struct Animation
+{
+  int w, h;
+  int loops; // 0 = forever
+  std::vector<AnimationFrame> frames;
+};
+
+class animation
+{
+ public:
+  // loads an animated GIF or APNG; false if the file is not an animation (or broken)
+  static bool load(const char* file, Animation& anim);
+ private:
+  static bool loadAPNG(const std::string& data, Animation& anim);
+  static bool loadGIF(const char* file, Animation& anim);
+};
+
+#endif
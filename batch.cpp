@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2014 Przemysław Grzywacz <nexather@gmail.com>
+ * This file is part of xbrzscale.
+ *
+ * xbrzscale is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "batch.h"
+
+#include <SDL2/SDL_image.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libxbrzscale.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+//images waiting between two stages; the scaled ones are up to 36 times the size of the source
+const size_t QUEUE_CAPACITY = 2;
+//loading is mostly I/O and inflating; the encoders have the most work, on images scale^2 times larger
+const int DECODER_THREADS = 2;
+
+struct Image
+{
+  int index;
+  SDL_Surface* surface;
+};
+
+// where the threads of a stage spent their time, in nanoseconds
+struct StageStats
+{
+  const char* name;
+  int threads;
+  std::atomic<long long> busy{0};
+  std::atomic<long long> starved{0}; // waiting for input
+  std::atomic<long long> blocked{0}; // waiting for room in the next queue
+};
+
+long long nanosSince(Clock::time_point& since){
+  const Clock::time_point now = Clock::now();
+  const long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - since).count();
+  since = now;
+  return ns;
+}
+
+// push() blocks while the queue is full, pop() while it is empty; pop() returns false once the queue is closed and empty
+class ImageQueue
+{
+ public:
+  void push(const Image& image){
+    std::unique_lock<std::mutex> lock(m);
+    changed.wait(lock, [&] { return images.size() < QUEUE_CAPACITY; });
+    images.push_back(image);
+    changed.notify_all();
+  }
+  void close(){
+    std::lock_guard<std::mutex> lock(m);
+    closed = true;
+    changed.notify_all();
+  }
+  bool pop(Image& image){
+    std::unique_lock<std::mutex> lock(m);
+    changed.wait(lock, [&] { return closed || !images.empty(); });
+    if (images.empty())
+      return false;
+    image = images.front();
+    images.pop_front();
+    changed.notify_all();
+    return true;
+  }
+ private:
+  std::mutex m;
+  std::condition_variable changed;
+  std::deque<Image> images;
+  bool closed = false;
+};
+
+std::string outputName(const std::string& outDir, const std::string& input){
+  const size_t slash = input.find_last_of("/\\");
+  std::string name = slash == std::string::npos ? input : input.substr(slash + 1);
+  const size_t dot = name.rfind('.');
+  if (dot != std::string::npos && dot > 0)
+    name.erase(dot);
+  return outDir + "/" + name + ".png";
+}
+
+void report(const StageStats& stage, double seconds){
+  const double total = seconds * 1e9 * stage.threads / 100;
+  printf("%-8s %7d %5.0f%% %7.0f%% %7.0f%%\n", stage.name, stage.threads,
+         stage.busy / total, stage.starved / total, stage.blocked / total);
+}
+
+}
+
+int batch::run(int scale, const char* outDir, int count, char** inputs){
+  //e.g. a/x.png and b/x.png, or x.png and x.jpg: two encoders would write the same file at once
+  std::map<std::string, int> names;
+  for (int i = 0; i < count; i++) {
+    const auto inserted = names.emplace(outputName(outDir, inputs[i]), i);
+    if (!inserted.second) {
+      fprintf(stderr, "'%s' and '%s' would both be written to '%s'\n", inputs[inserted.first->second], inputs[i],
+              inserted.first->first.c_str());
+      return 1;
+    }
+  }
+
+  const int encoders = libxbrzscale::getThreadCount();
+  StageStats decode{"decode", std::min(DECODER_THREADS, count)};
+  StageStats scaler{"scale", 1};
+  StageStats encode{"encode", std::min(encoders, count)};
+  ImageQueue decoded, scaled;
+  std::atomic<int> nextInput(0), decodersLeft(decode.threads), failed(0);
+  const Clock::time_point start = Clock::now();
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < decode.threads; t++)
+    threads.emplace_back([&]() {
+      Clock::time_point mark = Clock::now();
+      for (int i; (i = nextInput++) < count;) {
+        SDL_Surface* surface = IMG_Load(inputs[i]);
+        decode.busy += nanosSince(mark);
+        if (!surface) {
+          fprintf(stderr, "Failed to load source image '%s': %s\n", inputs[i], IMG_GetError());
+          failed++;
+          continue;
+        }
+        decoded.push(Image{i, surface});
+        decode.blocked += nanosSince(mark);
+      }
+      if (--decodersLeft == 0)
+        decoded.close();
+    });
+
+  for (int t = 0; t < encode.threads; t++)
+    threads.emplace_back([&]() {
+      Clock::time_point mark = Clock::now();
+      for (Image image; scaled.pop(image);) {
+        encode.starved += nanosSince(mark);
+        const std::string name = outputName(outDir, inputs[image.index]);
+        const bool saved = libxbrzscale::savePNG(image.surface, name.c_str(), 1); //the stage has a thread per image
+        SDL_FreeSurface(image.surface);
+        encode.busy += nanosSince(mark);
+        if (saved)
+          printf("%s -> %s\n", inputs[image.index], name.c_str());
+        else
+          failed++;
+      }
+      encode.starved += nanosSince(mark);
+    });
+
+  //the scaler stage: one image at a time, split across all threads by libxbrzscale::scale()
+  Clock::time_point mark = Clock::now();
+  for (Image image; decoded.pop(image);) {
+    scaler.starved += nanosSince(mark);
+    image.surface = libxbrzscale::scale(image.surface, scale); //frees the source
+    scaler.busy += nanosSince(mark);
+    if (!image.surface) {
+      fprintf(stderr, "Failed to scale '%s'\n", inputs[image.index]);
+      failed++;
+      continue;
+    }
+    scaled.push(image);
+    scaler.blocked += nanosSince(mark);
+  }
+  scaler.starved += nanosSince(mark);
+  scaled.close();
+  for (std::thread& t : threads)
+    t.join();
+
+  const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  printf("Scaled %d of %d images in %.2f s\n", count - failed, count, seconds);
+  printf("stage    threads  busy  starved  blocked\n");
+  report(decode, seconds);
+  report(scaler, seconds);
+  report(encode, seconds);
+  return failed ? 1 : 0;
+}
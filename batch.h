@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2014 Przemysław Grzywacz <nexather@gmail.com>
+ * This file is part of xbrzscale.
+ *
+ * xbrzscale is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+/*
+ * xbrzscale --batch: scales many image files in three overlapping stages instead of one file after the other. Decoder threads load the
+ * input files, the scaler runs xBRZ on one image at a time across all threads, and encoder threads write the PNGs. The stages are
+ * connected by short queues: a stage that gets ahead waits for the next one, so only a few images are held in memory at any time.
+ *
+ * At the end, the share of the time each stage spent working, waiting for input and waiting for room in its output queue is printed.
+ */
+class batch
+{
+ public:
+  // scales each of inputs[0 .. count) to outDir/<file name>.png, refusing inputs that map to the same output; returns the exit code
+  static int run(int scale, const char* outDir, int count, char** inputs);
+};
+
+#endif
@@ -20,11 +20,29 @@
 
 #include <SDL2/SDL_endian.h>
 #include <SDL2/SDL_error.h>
+#include <SDL2/SDL_image.h>
 #include <SDL2/SDL_pixels.h>
 #include <SDL2/SDL_surface.h>
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
+#include "pngwriter.h"
 #include "xbrz/xbrz.h"
+#include "xbrz/xbrz_tools.h"
 
 //#include <cstdio>
 //#include <cstdint>
@@ -33,6 +51,63 @@
 //#include "xbrz/xbrz.h"
 
 bool libxbrzscale::bEnableOutput=false;
+bool libxbrzscale::bSkipTransparent=false;
+int libxbrzscale::iThreadCount=0;
+thread_local int libxbrzscale::iThreadLimit=0;
+size_t libxbrzscale::iMaxMemory=0;
+bool libxbrzscale::bDetectUpscaled=false;
+bool libxbrzscale::bHugePages=false;
+bool libxbrzscale::bMemoize=false;
+bool libxbrzscale::bPipeline=false;
+
+//xBRZ reads source rows up to 2 away from the one being scaled
+static const int XBRZ_HALO=2;
+//colour distance lookup table of ColorFormat::ARGB/ARGB_OPAQUE, allocated on first use
+static const size_t DISTANCE_LUT_BYTES=256*256*256*sizeof(float);
+//deflate state and row buffers of pngwriter, heap slack
+static const size_t OVERHEAD_BYTES=4*1024*1024;
+//bands smaller than this make the first-row overhead of xBRZ noticeable: rather use fewer threads
+static const int MIN_BAND_ROWS=16;
+//target pixels per stripe of scaleAsync(): bounds how long cancel() takes to have an effect
+static const size_t ASYNC_STRIPE_PIXELS=1024*1024;
+//rows per stripe of FrameScaler: how closely a deadline can be met, against xBRZ's first-row overhead
+static const int FRAME_STRIPE_ROWS=16;
+//stripe timings FrameScaler predicts the next stripe from
+static const size_t FRAME_TIMING_SAMPLES=8;
+
+//largest xBRZ factor that divides scale; the rest is left to nearest neighbor
+static int xbrzFactor(int scale){
+  int factor = xbrz::SCALE_FACTOR_MAX;
+  while(factor > 2 && scale % factor != 0)
+    factor--;
+  return factor;
+}
+
+//every pixel equals its right neighbor, except for the last one of each run of k
+static bool rowDuplicated(const uint32_t* row, int width, int k){
+  int x = 0;
+#ifdef XBRZ_HAVE_SSE2
+  //4 neighbor comparisons at a time; which of them have to match depends on where x falls within a run
+  unsigned required[xbrz::SCALE_FACTOR_MAX];
+  for(int phase = 0; phase < k; phase++) {
+    required[phase] = 0;
+    for(int i = 0; i < 4; i++)
+      if((phase + i + 1) % k != 0)
+        required[phase] |= 1U << i;
+  }
+  for(int phase = 0; x + 5 <= width; x += 4, phase = (phase + 4) % k) {
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x + 1));
+    const unsigned equal = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b)));
+    if((equal & required[phase]) != required[phase])
+      return false;
+  }
+#endif
+  for(; x + 1 < width; x++)
+    if((x + 1) % k != 0 && row[x] != row[x + 1])
+      return false;
+  return true;
+}
 
 Uint32 libxbrzscale::SDL_GetPixel(SDL_Surface *surface, int x, int y)
 {
@@ -135,9 +210,12 @@ void displayImage(SDL_Surface* surface, const char* message) {
 */
 
 uint32_t* libxbrzscale::surfaceToUint32(SDL_Surface* img){
-  uint32_t *data = new uint32_t[img->w * img->h];
+  uint32_t *data = new (std::nothrow) uint32_t[size_t(img->w) * img->h];
+  if (!data) return NULL;
+  adviseHugePages(data, size_t(img->w) * img->h * sizeof(uint32_t));
 
-  int x, y, offset=0;
+  int x, y;
+  size_t offset=0;
   Uint8 r, g, b, a;
   for(y = 0; y < img->h; y++) {
     for(x = 0; x < img->w; x++) {
@@ -160,7 +238,8 @@ uint32_t* libxbrzscale::surfaceToUint32(SDL_Surface* img){
 }
 
 void libxbrzscale::uint32toSurface(uint32_t* ui32src, SDL_Surface* dst_img){
-  int x, y, offset=0;
+  int x, y;
+  size_t offset=0;
   Uint8 r, g, b, a;
   for(y = 0; y < dst_img->h; y++) {
     for(x = 0; x < dst_img->w; x++) {
@@ -179,30 +258,851 @@ void libxbrzscale::uint32toSurface(uint32_t* ui32src, SDL_Surface* dst_img){
   }
 }
 
+bool libxbrzscale::isOpaque(const uint32_t* data, size_t count){
+  //AND all pixels together in blocks: vectorizes well and bails out early on the first transparent block
+  const size_t BLOCK_SIZE = 1024;
+  for(size_t i = 0; i < count; i += BLOCK_SIZE) {
+    const size_t blockEnd = std::min(count, i + BLOCK_SIZE);
+    uint32_t acc = 0xffffffffU;
+    for(size_t j = i; j < blockEnd; j++)
+      acc &= data[j];
+    if((acc >> 24) != 0xff)
+      return false;
+  }
+  return true;
+}
+
+int libxbrzscale::pixelSize(const uint32_t* data, int width, int height){
+  //largest k such that the image consists of uniform k x k blocks, i.e. is a nearest-neighbor upscale of a k times smaller image
+  for(int k = xbrz::SCALE_FACTOR_MAX; k >= 2; k--) {
+    if(width % k != 0 || height % k != 0)
+      continue;
+    //first row of each block: runs of k equal pixels; the other k - 1 rows: copies of it
+    bool uniform = true;
+    for(int y = 0; uniform && y < height; y++) {
+      const uint32_t* row = data + size_t(y) * width;
+      uniform = y % k == 0 ? rowDuplicated(row, width, k) : memcmp(row, row - size_t(y % k) * width, size_t(width) * sizeof(uint32_t)) == 0;
+    }
+    if(uniform)
+      return k;
+  }
+  return 1;
+}
+
+size_t libxbrzscale::getPeakMemory(){
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS pmc;
+  if(!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+    return 0;
+  return pmc.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss; //bytes
+#else
+  return size_t(usage.ru_maxrss) * 1024; //kilobytes
+#endif
+#endif
+}
+
+size_t libxbrzscale::getHugePageMemory(){
+  //transparent huge pages of all mappings plus explicit (hugetlbfs) ones
+  size_t total = 0;
+#ifdef __linux__
+  const char* files[] = { "/proc/self/smaps_rollup", "/proc/self/status" };
+  const char* keys[] = { "AnonHugePages: %zu kB", "HugetlbPages: %zu kB" };
+  for(int i = 0; i < 2; i++) {
+    FILE* f = fopen(files[i], "r");
+    if(!f)
+      continue;
+    char line[256];
+    size_t kb;
+    while(fgets(line, sizeof(line), f))
+      if(sscanf(line, keys[i], &kb) == 1)
+        total += kb * 1024;
+    fclose(f);
+  }
+#endif
+  return total;
+}
+
+void libxbrzscale::setShareDistanceTable(bool b){
+  xbrz::setShareDistanceBuffers(b);
+}
+
+void libxbrzscale::adviseHugePages(void* data, size_t bytes){
+  //only pages that are touched afterwards are affected: call right after allocating
+#ifdef __linux__
+  const uintptr_t PAGE = 4096;
+  const uintptr_t first = (reinterpret_cast<uintptr_t>(data) + PAGE - 1) & ~(PAGE - 1);
+  const uintptr_t last = (reinterpret_cast<uintptr_t>(data) + bytes) & ~(PAGE - 1);
+  if(bHugePages && last > first)
+    madvise(reinterpret_cast<void*>(first), last - first, MADV_HUGEPAGE);
+#else
+  (void)data;
+  (void)bytes;
+#endif
+}
+
+void libxbrzscale::reportHugePages(){
+  if(!bHugePages || !bEnableOutput)
+    return;
+  const xbrz::DistanceBufferStats lut = xbrz::getDistanceBufferStats();
+  const size_t total = getHugePageMemory();
+  if(lut.sharedBytes)
+    printf("Huge pages: distance table is shared, %zu MB image buffers\n", total >> 20);
+  else
+    printf("Huge pages: %zu of %zu MB distance table, %zu MB image buffers\n", lut.hugePageBytes >> 20, lut.bytes >> 20,
+           (total > lut.hugePageBytes ? total - lut.hugePageBytes : 0) >> 20);
+}
+
+void libxbrzscale::reportMemo(){
+  if(!bMemoize || !bEnableOutput)
+    return;
+  const xbrz::MemoStats memo = xbrz::getMemoStats();
+  printf("Block memo: %.1f%% of %llu blended pixels reused", memo.lookups ? 100.0 * memo.hits / memo.lookups : 0.0, (unsigned long long)memo.lookups);
+  if(memo.bailouts)
+    printf(", switched off in %llu scale calls (too few repeats)", (unsigned long long)memo.bailouts);
+  printf("\n");
+}
+
+xbrz::ScalerCfg libxbrzscale::scalerCfg(){
+  xbrz::ScalerCfg cfg;
+  cfg.memoizeBlocks = bMemoize;
+  return cfg;
+}
+
+uint32_t* libxbrzscale::surfacePixels(SDL_Surface* img){
+  //same layout as xBRZ's buffers (32 bit ARGB, no row padding): scale straight into the surface
+  if(img->format->format == SDL_PIXELFORMAT_ARGB8888 && img->pitch == img->w * 4 && !SDL_MUSTLOCK(img))
+    return static_cast<uint32_t*>(img->pixels);
+  return NULL;
+}
+
+int libxbrzscale::getThreadCount(){
+  const int n = iThreadCount > 0 ? iThreadCount : std::max(1U, std::thread::hardware_concurrency());
+  return iThreadLimit > 0 ? std::min(n, iThreadLimit) : n;
+}
+
+void libxbrzscale::parallelFor(size_t count, const std::function<void(size_t)>& fn, size_t maxThreads){
+  const size_t threads = std::min<size_t>(count, maxThreads ? maxThreads : getThreadCount());
+  if(threads <= 1) {
+    for(size_t i = 0; i < count; i++)
+      fn(i);
+    return;
+  }
+
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for(size_t i; (i = next++) < count;)
+      fn(i);
+  };
+
+  std::vector<std::thread> pool;
+  for(size_t t = 1; t < threads; t++)
+    pool.emplace_back(worker);
+  worker();
+  for(std::thread& t : pool)
+    t.join();
+}
+
+int libxbrzscale::scaleBuffer(int scale, const uint32_t* src, uint32_t* dst, int width, int height, bool pipelined){
+  const int k = bDetectUpscaled ? pixelSize(src, width, height) : 1;
+  if(k == 1) {
+    scaleXbrz(scale, src, dst, width, height, pipelined);
+    return 1;
+  }
+
+  //xBRZ on the native pixels: scale * k in total, of which xBRZ does as much as it can in one pass
+  const int nativeWidth = width / k;
+  const int nativeHeight = height / k;
+  const int factor = xbrzFactor(scale * k);
+  //the intermediate image is up to the size of the target: may not fit
+  uint32_t* native = new (std::nothrow) uint32_t[size_t(nativeWidth) * nativeHeight];
+  uint32_t* scaled = native && factor != scale * k ? new (std::nothrow) uint32_t[size_t(nativeWidth) * factor * nativeHeight * factor] : NULL;
+  if(!native || (factor != scale * k && !scaled)) {
+    delete [] native;
+    if(bEnableOutput)fprintf(stderr, "Not enough memory for a %dx%d image\n", nativeWidth * factor, nativeHeight * factor);
+    return 0;
+  }
+  xbrz::nearestNeighborScale(src, width, height, native, nativeWidth, nativeHeight);
+  if(!scaled) {
+    scaleXbrz(factor, native, dst, nativeWidth, nativeHeight, pipelined);
+  } else {
+    scaleXbrz(factor, native, scaled, nativeWidth, nativeHeight, pipelined);
+    xbrz::nearestNeighborScale(scaled, nativeWidth * factor, nativeHeight * factor, dst, width * scale, height * scale);
+  }
+  delete [] scaled;
+  delete [] native;
+  return k;
+}
+
+void libxbrzscale::scaleXbrz(int scale, const uint32_t* src, uint32_t* dst, int width, int height, bool pipelined){
+  //same result as ARGB, but skips the alpha weighting wherever both pixels are opaque
+  const xbrz::ColorFormat colFmt = isOpaque(src, size_t(width) * height) ? xbrz::ColorFormat::ARGB_OPAQUE : xbrz::ColorFormat::ARGB;
+  if(bSkipTransparent && colFmt != xbrz::ColorFormat::ARGB_OPAQUE)
+    xbrz::scaleSkipTransparent(scale, src, dst, width, height, colFmt, scalerCfg());
+  else if(pipelined)
+    xbrz::scalePipelined(scale, src, dst, width, height, colFmt, scalerCfg());
+  else
+    xbrz::scale(scale, src, dst, width, height, colFmt, scalerCfg());
+}
+
+void libxbrzscale::scaleParallel(int scale, const uint32_t* src, uint32_t* dst, int width, int height){
+  //same result as ARGB, but skips the alpha weighting wherever both pixels are opaque
+  const xbrz::ColorFormat colFmt = isOpaque(src, size_t(width) * height) ? xbrz::ColorFormat::ARGB_OPAQUE : xbrz::ColorFormat::ARGB;
+  if(bSkipTransparent && colFmt != xbrz::ColorFormat::ARGB_OPAQUE) {
+    xbrz::scaleSkipTransparent(scale, src, dst, width, height, colFmt, scalerCfg());
+    return;
+  }
+  const int threads = getThreadCount();
+  const int stripeRows = std::max(MIN_BAND_ROWS, (height + threads - 1) / threads);
+  parallelFor((height + stripeRows - 1) / stripeRows, [&](size_t i) {
+    xbrz::scale(scale, src, dst, width, height, colFmt, scalerCfg(), i * stripeRows, (i + 1) * stripeRows);
+  });
+}
+
+bool libxbrzscale::checkSize(int src_width, int src_height, int scale){
+  if(xbrz::canScale(scale, src_width, src_height))
+    return true;
+  if(bEnableOutput)fprintf(stderr, "Cannot scale a %dx%d image by %d: the result would be too large\n", src_width, src_height, scale);
+  return false;
+}
+
 SDL_Surface* libxbrzscale::scale(SDL_Surface* src_img, int scale){
   int src_width = src_img->w;
   int src_height = src_img->h;
+  if(!checkSize(src_width, src_height, scale)) {
+    SDL_FreeSurface(src_img);
+    return NULL;
+  }
   int dst_width = src_width * scale;
   int dst_height = src_height * scale;
 
   uint32_t *in_data = surfaceToUint32(src_img);
   SDL_FreeSurface(src_img);
 
-  if(bEnableOutput)printf("Scaling image...\n");
-  uint32_t* dest = new uint32_t[dst_width * dst_height];
+  SDL_Surface* dst_img = in_data ? createARGBSurface(dst_width, dst_height) : NULL;
+  if (!dst_img) {
+    delete [] in_data;
+    if(bEnableOutput)fprintf(stderr, "Failed to create SDL surface: %s\n", SDL_GetError());
+    return NULL;
+  }
 
-  xbrz::scale(scale, in_data, dest, src_width, src_height, xbrz::ColorFormat::ARGB);
+  //no intermediate copy of the target if the surface can take xBRZ's output as it is
+  uint32_t* dest = surfacePixels(dst_img);
+  const bool direct = dest != NULL;
+  if(!direct) dest = new (std::nothrow) uint32_t[size_t(dst_width) * dst_height];
+  if(!dest) {
+    delete [] in_data;
+    SDL_FreeSurface(dst_img);
+    if(bEnableOutput)fprintf(stderr, "Not enough memory for a %dx%d image\n", dst_width, dst_height);
+    return NULL;
+  }
+
+  adviseHugePages(dest, size_t(dst_width) * dst_height * sizeof(uint32_t));
+
+  if(bEnableOutput)printf("Scaling image...\n");
+  //the only xBRZ run at this point: a second thread can take over the analysis
+  const int k = scaleBuffer(scale, in_data, dest, src_width, src_height, bPipeline && getThreadCount() > 1);
+  reportHugePages();
+  reportMemo();
   delete [] in_data;
+  if(k == 0) {
+    if(!direct) delete [] dest;
+    SDL_FreeSurface(dst_img);
+    return NULL;
+  }
+  if(bEnableOutput && k > 1)printf("Input is a %dx nearest-neighbor upscale: scaled its %dx%d native pixels by %d\n", k, src_width / k, src_height / k, scale * k);
 
   if(bEnableOutput)printf("Saving image...\n");
+  if(!direct) {
+    uint32toSurface(dest,dst_img);
+    delete [] dest;
+  }
+
+  return dst_img;
+}
+
+bool libxbrzscale::scaleToPNG(SDL_Surface* src_img, int scale, const char* out_file){
+  int src_width = src_img->w;
+  int src_height = src_img->h;
+  if(!checkSize(src_width, src_height, scale)) {
+    SDL_FreeSurface(src_img);
+    return false;
+  }
+  int dst_width = src_width * scale;
+  int dst_height = src_height * scale;
+
+  const size_t base = getPeakMemory(); //whatever the process needed so far, including the decoded source image
+  uint32_t *in_data = surfaceToUint32(src_img);
+  SDL_FreeSurface(src_img);
+  if(!in_data) {
+    if(bEnableOutput)fprintf(stderr, "Not enough memory for a %dx%d image\n", src_width, src_height);
+    return false;
+  }
+
+  //nearest-neighbor upscaled input: bands of its native pixels, each scaled row is repeated to make up for the rest of the factor
+  const int k = bDetectUpscaled ? pixelSize(in_data, src_width, src_height) : 1;
+  const int factor = k > 1 ? xbrzFactor(scale * k) : scale;
+  const int repeat = scale * k / factor;
+  if(k > 1) {
+    uint32_t* native = new (std::nothrow) uint32_t[size_t(src_width / k) * (src_height / k)];
+    if(native)
+      xbrz::nearestNeighborScale(in_data, src_width, src_height, native, src_width / k, src_height / k);
+    delete [] in_data;
+    in_data = native;
+    src_width /= k;
+    src_height /= k;
+    if(!in_data) {
+      if(bEnableOutput)fprintf(stderr, "Not enough memory for a %dx%d image\n", src_width, src_height);
+      return false;
+    }
+    if(bEnableOutput)printf("Input is a %dx nearest-neighbor upscale: scaling its %dx%d native pixels by %d\n", k, src_width, src_height, scale * k);
+  }
+  const int bandWidth = src_width * factor;
+  std::vector<uint32_t> line(repeat > 1 ? dst_width : 0);
+
+  //budget for band buffers: the rest is fixed
+  const size_t budget = iMaxMemory ? iMaxMemory : SIZE_MAX;
+  const size_t fixed = base + (size_t(src_width) * src_height + line.size()) * sizeof(uint32_t) + OVERHEAD_BYTES;
+  const size_t rowBytes = size_t(bandWidth) * factor * sizeof(uint32_t); //one source row, scaled
+  const size_t minBand = (1 + 2 * XBRZ_HALO) * rowBytes;
+
+  const bool opaque = isOpaque(in_data, size_t(src_width) * src_height);
+  xbrz::ColorFormat colFmt = opaque ? xbrz::ColorFormat::ARGB_OPAQUE : xbrz::ColorFormat::ARGB;
+  size_t avail = budget > fixed + DISTANCE_LUT_BYTES ? budget - fixed - DISTANCE_LUT_BYTES : 0;
+  if(avail < minBand) {
+    //last resort: compute colour distances from each pixel's YCbCr; results may differ in a few pixels from the buffered formats
+    colFmt = xbrz::ColorFormat::ARGB_YCBCR;
+    avail = budget > fixed ? budget - fixed : 0;
+  }
+  if(avail < minBand) {
+    delete [] in_data;
+    if(bEnableOutput)fprintf(stderr, "Memory limit too low: need at least %zu MB\n", (fixed + minBand + (1 << 20) - 1) >> 20);
+    return false;
+  }
+
+  //as many threads as there is memory for bands of a reasonable height; the whole image at once if it fits
+  size_t threads = std::min<size_t>(getThreadCount(), src_height);
+  int bandRows = 1;
+  for(;; threads--) {
+    const size_t perThread = avail / threads / rowBytes;
+    const int fairShare = (src_height + threads - 1) / threads;
+    bandRows = perThread > size_t(2 * XBRZ_HALO) ? int(std::min<size_t>(perThread - 2 * XBRZ_HALO, fairShare)) : 0;
+    if(bandRows >= std::min(MIN_BAND_ROWS, fairShare) || threads == 1)
+      break;
+  }
+  bandRows = std::max(bandRows, 1);
+
+  if(bEnableOutput)printf("Scaling image in bands of %d rows on %zu threads%s...\n", bandRows, threads,
+                          colFmt == xbrz::ColorFormat::ARGB_YCBCR ? " without distance buffer" : "");
+
+  pngwriter png;
+  bool ok = png.open(out_file, dst_width, dst_height);
+
+  //each band is scaled as part of a sub-image that includes the rows xBRZ reads around it: same result as scaling the whole image
+  std::vector<std::vector<uint32_t>> bands(threads);
+  for(std::vector<uint32_t>& band : bands)
+    band.reserve(size_t(bandRows + 2 * XBRZ_HALO) * rowBytes / sizeof(uint32_t)); //growing a band would hold two copies for a moment
+  for(int y = 0; ok && y < src_height; y += threads * bandRows) {
+    parallelFor(threads, [&](size_t t) {
+      const int yFirst = y + t * bandRows;
+      if(yFirst >= src_height)
+        return;
+      const int yLast = std::min(src_height, yFirst + bandRows);
+      const int top = std::max(0, yFirst - XBRZ_HALO);
+      const int bottom = std::min(src_height, yLast + XBRZ_HALO);
+      const uint32_t* sub = in_data + size_t(top) * src_width;
+
+      bands[t].resize(size_t(bottom - top) * rowBytes / sizeof(uint32_t));
+      if(bSkipTransparent && !opaque)
+        xbrz::scaleSkipTransparent(factor, sub, bands[t].data(), src_width, bottom - top, colFmt, scalerCfg());
+      else
+        xbrz::scale(factor, sub, bands[t].data(), src_width, bottom - top, colFmt, scalerCfg(), yFirst - top, yLast - top);
+    }, threads);
+
+    for(size_t t = 0; ok && t < threads && y + int(t) * bandRows < src_height; t++) {
+      const int yFirst = y + t * bandRows;
+      const int yLast = std::min(src_height, yFirst + bandRows);
+      const int top = std::max(0, yFirst - XBRZ_HALO);
+      const uint32_t* rows = bands[t].data() + size_t(yFirst - top) * factor * bandWidth;
+      if(repeat == 1) {
+        ok = png.writeRows(rows, (yLast - yFirst) * factor);
+        continue;
+      }
+      for(int row = 0; ok && row < (yLast - yFirst) * factor; row++) {
+        const uint32_t* p = rows + size_t(row) * bandWidth;
+        for(int x = 0; x < dst_width; x++)
+          line[x] = p[x / repeat];
+        for(int i = 0; ok && i < repeat; i++)
+          ok = png.writeRows(line.data(), 1);
+      }
+    }
+  }
+  reportHugePages();
+  reportMemo();
+  delete [] in_data;
+
+  return png.close() && ok;
+}
+
+bool libxbrzscale::savePNG(SDL_Surface* img, const char* out_file, int threads){
+  //straight from the surface: IMG_SavePNG() may convert it to another pixel format first, i.e. copy it, and deflates on one thread
+  const uint32_t* pixels = surfacePixels(img);
+  if(!pixels) {
+    //reported here, like pngwriter does for its own errors
+    if(IMG_SavePNG(img, out_file) == 0)
+      return true;
+    fprintf(stderr, "Failed to write '%s': %s\n", out_file, IMG_GetError());
+    return false;
+  }
+
+  if(iMaxMemory) {
+    //one row at a time: the parallel chunks are held in memory until all are done
+    pngwriter png;
+    return png.open(out_file, img->w, img->h) && png.writeRows(pixels, img->h) && png.close();
+  }
+  return pngwriter::save(out_file, pixels, img->w, img->h, threads > 0 ? threads : getThreadCount());
+}
+
+ScaleJob::~ScaleJob(){
+  cancel();
+  if(result.valid()) {
+    SDL_Surface* dst_img = result.get();
+    if(dst_img) SDL_FreeSurface(dst_img);
+  }
+}
+
+std::unique_ptr<ScaleJob> libxbrzscale::scaleAsync(SDL_Surface* src_img, int scale, const std::function<void(int done, int total)>& progress){
+  std::unique_ptr<ScaleJob> job(new ScaleJob);
+  ScaleJob* const state = job.get(); //outlives the task: ~ScaleJob() waits for it
+
+  job->result = std::async(std::launch::async, [=]() -> SDL_Surface* {
+    int src_width = src_img->w;
+    int src_height = src_img->h;
+    if(state->cancelled || !checkSize(src_width, src_height, scale)) {
+      SDL_FreeSurface(src_img);
+      return NULL;
+    }
+    int dst_width = src_width * scale;
+    int dst_height = src_height * scale;
+
+    uint32_t *in_data = surfaceToUint32(src_img);
+    SDL_FreeSurface(src_img);
+    if(state->cancelled) {
+      delete [] in_data;
+      return NULL;
+    }
+
+    SDL_Surface* dst_img = in_data ? createARGBSurface(dst_width, dst_height) : NULL;
+    uint32_t* dest = dst_img ? surfacePixels(dst_img) : NULL;
+    const bool direct = dest != NULL;
+    if(dst_img && !direct) dest = new (std::nothrow) uint32_t[size_t(dst_width) * dst_height];
+    if(!dest) {
+      delete [] in_data;
+      if(dst_img) SDL_FreeSurface(dst_img);
+      if(bEnableOutput)fprintf(stderr, "Not enough memory for a %dx%d image\n", dst_width, dst_height);
+      return NULL;
+    }
+
+    //short stripes, so that a cancel() does not have to wait long
+    const int stripeRows = std::max<int>(MIN_BAND_ROWS, ASYNC_STRIPE_PIXELS / (size_t(dst_width) * scale));
+    const int stripes = (src_height + stripeRows - 1) / stripeRows;
+    state->total = stripes;
+
+    //same result as ARGB, but skips the alpha weighting wherever both pixels are opaque
+    const xbrz::ColorFormat colFmt = isOpaque(in_data, size_t(src_width) * src_height) ? xbrz::ColorFormat::ARGB_OPAQUE : xbrz::ColorFormat::ARGB;
+    std::mutex progressLock;
+    parallelFor(stripes, [&](size_t i) {
+      if(state->cancelled)
+        return;
+      xbrz::scale(scale, in_data, dest, src_width, src_height, colFmt, scalerCfg(), i * stripeRows, (i + 1) * stripeRows);
+      std::lock_guard<std::mutex> lock(progressLock);
+      const int done = ++state->done;
+      if(progress) progress(done, stripes);
+    });
+    delete [] in_data;
+
+    if(!direct) {
+      if(!state->cancelled) uint32toSurface(dest,dst_img);
+      delete [] dest;
+    }
+    if(state->cancelled) {
+      SDL_FreeSurface(dst_img);
+      return NULL;
+    }
+    return dst_img;
+  });
+  return job;
+}
+
+FrameScaler::FrameScaler(int w, int h, int scale) : width(w), height(h), factor(scale), stripeRows(std::max(1, std::min(h, FRAME_STRIPE_ROWS))),
+  prev(size_t(w) * h), dest(size_t(w) * scale * h * scale), stripes((h + stripeRows - 1) / stripeRows, STALE), nextSample(0){
+  //xBRZ creates its distance table on first use: not on the clock of the first frame
+  uint32_t tiny[4 * 4];
+  uint32_t tinyScaled[4 * 4 * 2 * 2];
+  for(int i = 0; i < 4 * 4; i++)
+    tiny[i] = i % 3 ? 0xffffffff : 0xff000000; //a uniform image would not need a single color distance
+  xbrz::scale(2, tiny, tinyScaled, 4, 4, xbrz::ColorFormat::ARGB, libxbrzscale::scalerCfg());
+}
+
+const uint32_t* FrameScaler::scaleFrame(const uint32_t* frame, std::chrono::steady_clock::time_point deadline){
+  typedef std::chrono::steady_clock clock;
+  const clock::time_point start = clock::now();
+
+  //a changed row invalidates the stripes within XBRZ_HALO rows of it
+  for(int y = 0; y < height; y++) {
+    const uint32_t* row = frame + size_t(y) * width;
+    uint32_t* old = prev.data() + size_t(y) * width;
+    if(memcmp(row, old, width * sizeof(uint32_t)) == 0)
+      continue;
+    std::copy_n(row, width, old);
+    const int first = std::max(0, y - XBRZ_HALO) / stripeRows;
+    const int last = std::min(height - 1, y + XBRZ_HALO) / stripeRows;
+    for(int s = first; s <= last; s++)
+      stripes[s] = STALE;
+  }
+
+  //outdated stripes first, then the refinement of what earlier frames left in nearest neighbor
+  std::vector<int> order;
+  for(StripeState state : {STALE, NEAREST})
+    for(size_t s = 0; s < stripes.size(); s++)
+      if(stripes[s] == state)
+        order.push_back(s);
+
+  //same result as ARGB, but skips the alpha weighting wherever both pixels are opaque
+  const xbrz::ColorFormat colFmt = libxbrzscale::isOpaque(prev.data(), prev.size()) ? xbrz::ColorFormat::ARGB_OPAQUE : xbrz::ColorFormat::ARGB;
+  const size_t threads = std::min<size_t>(libxbrzscale::getThreadCount(), order.size());
+  //the median ignores the odd stripe that was preempted or evicted from the cache
+  std::vector<double> samples = stripeSeconds;
+  std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+  const std::chrono::duration<double> predicted(samples.empty() ? 0 : samples[samples.size() / 2]);
+  std::atomic<size_t> next(0);
+  std::mutex timingLock;
+  int scaled = 0;
+  libxbrzscale::parallelFor(threads, [&](size_t) {
+    for(size_t i; (i = next++) < order.size();) {
+      const clock::time_point t0 = clock::now();
+      //no time left for this stripe: neither for the ones after it, which are less urgent
+      if(t0 + predicted > deadline)
+        return;
+      const int s = order[i];
+      xbrz::scale(factor, prev.data(), dest.data(), width, height, colFmt, libxbrzscale::scalerCfg(), s * stripeRows, (s + 1) * stripeRows);
+      stripes[s] = SCALED;
+
+      const double seconds = std::chrono::duration<double>(clock::now() - t0).count();
+      std::lock_guard<std::mutex> lock(timingLock);
+      if(stripeSeconds.size() < FRAME_TIMING_SAMPLES)
+        stripeSeconds.push_back(seconds);
+      else
+        stripeSeconds[nextSample++ % FRAME_TIMING_SAMPLES] = seconds;
+      scaled++;
+    }
+  }, threads);
+
+  //whatever is still outdated at the deadline shows the new frame at least in nearest neighbor
+  int fallback = 0;
+  int pending = 0;
+  for(size_t s = 0; s < stripes.size(); s++) {
+    if(stripes[s] == STALE) {
+      xbrz::nearestNeighborScaleOverSource(prev.data(), width, height, width * sizeof(uint32_t),
+                                           dest.data(), width * factor, height * factor, width * factor * sizeof(uint32_t),
+                                           s * stripeRows, (s + 1) * stripeRows, [](uint32_t pix) { return pix; });
+      stripes[s] = NEAREST;
+      fallback++;
+    }
+    if(stripes[s] == NEAREST)
+      pending++;
+  }
+
+  const clock::time_point end = clock::now();
+  const double ms = std::chrono::duration<double, std::milli>(end - start).count();
+  stats.frames++;
+  if(pending > 0) stats.fallbackFrames++;
+  if(end > deadline) stats.overruns++;
+  stats.lastMs = ms;
+  stats.maxMs = std::max(stats.maxMs, ms);
+  stats.totalMs += ms;
+  stats.lastScaled = scaled;
+  stats.lastFallback = fallback;
+  stats.pending = pending;
+  return dest.data();
+}
+
+bool libxbrzscale::scaleMulti(SDL_Surface* src_img, const std::vector<int>& scales, std::vector<SDL_Surface*>& dst_imgs){
+  int src_width = src_img->w;
+  int src_height = src_img->h;
+  dst_imgs.clear();
+  for(int scale : scales) {
+    if(!checkSize(src_width, src_height, scale)) {
+      SDL_FreeSurface(src_img);
+      return false;
+    }
+  }
+
+  uint32_t *in_data = surfaceToUint32(src_img);
+  SDL_FreeSurface(src_img);
+  if(!in_data)
+    return false;
+
+  std::vector<uint32_t*> dests;
+  std::vector<bool> direct;
+  bool ok = true;
+  for(size_t i = 0; ok && i < scales.size(); i++) {
+    const int dst_width = src_width * scales[i];
+    const int dst_height = src_height * scales[i];
+    SDL_Surface* dst_img = createARGBSurface(dst_width, dst_height);
+    if(!dst_img) {
+      if(bEnableOutput)fprintf(stderr, "Failed to create SDL surface: %s\n", SDL_GetError());
+      ok = false;
+      break;
+    }
+    dst_imgs.push_back(dst_img);
+    uint32_t* dest = surfacePixels(dst_img);
+    direct.push_back(dest != NULL);
+    if(!dest) dest = new (std::nothrow) uint32_t[size_t(dst_width) * dst_height];
+    dests.push_back(dest);
+    if(!dest) {
+      if(bEnableOutput)fprintf(stderr, "Not enough memory for a %dx%d image\n", dst_width, dst_height);
+      ok = false;
+    } else {
+      adviseHugePages(dest, size_t(dst_width) * dst_height * sizeof(uint32_t));
+    }
+  }
+
+  if(ok) {
+    //which corners get blended does not depend on the scale factor: analyze once, then render every factor from the same map
+    const xbrz::ColorFormat colFmt = isOpaque(in_data, size_t(src_width) * src_height) ? xbrz::ColorFormat::ARGB_OPAQUE : xbrz::ColorFormat::ARGB;
+    const int bandRows = std::max(MIN_BAND_ROWS, src_height / getThreadCount());
+    const size_t bands = (src_height + bandRows - 1) / bandRows;
+    std::vector<unsigned char> blendMap(size_t(src_width) * src_height);
+
+    if(bEnableOutput)printf("Analyzing image...\n");
+    parallelFor(bands, [&](size_t b) {
+      xbrz::computeBlendMap(in_data, blendMap.data(), src_width, src_height, colFmt, scalerCfg(), b * bandRows, (b + 1) * bandRows);
+    });
+
+    if(bEnableOutput)printf("Scaling image by %zu factors...\n", scales.size());
+    parallelFor(scales.size() * bands, [&](size_t i) {
+      const size_t b = i % bands;
+      const int scale = scales[i / bands];
+      xbrz::scaleWithBlendMap(scale, in_data, blendMap.data(), dests[i / bands], src_width, src_height, colFmt, scalerCfg(), b * bandRows, (b + 1) * bandRows);
+    });
+    reportHugePages();
+    reportMemo();
+  }
+  delete [] in_data;
+
+  for(size_t i = 0; i < dests.size(); i++) {
+    if(!direct[i] && dests[i]) {
+      if(ok) uint32toSurface(dests[i], dst_imgs[i]);
+      delete [] dests[i];
+    }
+  }
+  if(!ok) {
+    for(SDL_Surface* dst_img : dst_imgs)
+      SDL_FreeSurface(dst_img);
+    dst_imgs.clear();
+  }
+  return ok;
+}
+
+SDL_Surface* libxbrzscale::scaleAtlas(SDL_Surface* src_img, int scale, const std::vector<SDL_Rect>& rects){
+  int src_width = src_img->w;
+  int src_height = src_img->h;
+  if(!checkSize(src_width, src_height, scale)) {
+    SDL_FreeSurface(src_img);
+    return NULL;
+  }
+  int dst_width = src_width * scale;
+  int dst_height = src_height * scale;
+
+  const size_t base = getPeakMemory();
+  uint32_t *in_data = surfaceToUint32(src_img);
+  SDL_FreeSurface(src_img);
+  if(!in_data) {
+    if(bEnableOutput)fprintf(stderr, "Not enough memory for a %dx%d image\n", src_width, src_height);
+    return NULL;
+  }
+
+  //sprites are scaled in isolation: clip them to the atlas and scale aliased (identical) rects only once
+  std::vector<SDL_Rect> sprites;
+  for(const SDL_Rect& r : rects) {
+    SDL_Rect c;
+    c.x = std::max(r.x, 0);
+    c.y = std::max(r.y, 0);
+    c.w = std::min(r.x + r.w, src_width) - c.x;
+    c.h = std::min(r.y + r.h, src_height) - c.y;
+    if(c.w <= 0 || c.h <= 0)
+      continue;
+    bool dup = false;
+    for(const SDL_Rect& s : sprites)
+      dup = dup || (s.x == c.x && s.y == c.y && s.w == c.w && s.h == c.h);
+    if(!dup)
+      sprites.push_back(c);
+  }
+
+  //sprites that overlap write to the same target pixels: each group of them is scaled on one thread, in the order of the atlas, so the
+  //last one listed wins like in a serial run
+  std::vector<size_t> parent(sprites.size());
+  auto root = [&](size_t i) {
+    while(parent[i] != i)
+      i = parent[i] = parent[parent[i]];
+    return i;
+  };
+  for(size_t i = 0; i < sprites.size(); i++) {
+    parent[i] = i;
+    const SDL_Rect& a = sprites[i];
+    for(size_t j = 0; j < i; j++) {
+      const SDL_Rect& b = sprites[j];
+      if(a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h)
+        parent[root(j)] = root(i);
+    }
+  }
+  std::vector<std::vector<size_t>> groups;
+  std::vector<size_t> groupIndex(sprites.size(), SIZE_MAX);
+  for(size_t i = 0; i < sprites.size(); i++) {
+    const size_t r = root(i);
+    if(groupIndex[r] == SIZE_MAX) {
+      groupIndex[r] = groups.size();
+      groups.emplace_back();
+    }
+    groups[groupIndex[r]].push_back(i);
+  }
+
   SDL_Surface* dst_img = createARGBSurface(dst_width, dst_height);
   if (!dst_img) {
-    delete [] dest;
+    delete [] in_data;
     if(bEnableOutput)fprintf(stderr, "Failed to create SDL surface: %s\n", SDL_GetError());
     return NULL;
   }
 
-  uint32toSurface(dest,dst_img);
+  uint32_t* dest = surfacePixels(dst_img);
+  const bool direct = dest != NULL;
+  if(!direct) dest = new (std::nothrow) uint32_t[size_t(dst_width) * dst_height];
+  if(!dest) {
+    delete [] in_data;
+    SDL_FreeSurface(dst_img);
+    if(bEnableOutput)fprintf(stderr, "Not enough memory for a %dx%d image\n", dst_width, dst_height);
+    return NULL;
+  }
+
+  adviseHugePages(dest, size_t(dst_width) * dst_height * sizeof(uint32_t));
+
+  //every thread holds one sprite and its scaled copy: with a memory limit, only run as many threads as there is room for
+  size_t threads = getThreadCount();
+  if(iMaxMemory) {
+    size_t spriteBytes = 0;
+    for(const SDL_Rect& r : sprites)
+      spriteBytes = std::max(spriteBytes, size_t(r.w) * r.h * (1 + scale * scale) * sizeof(uint32_t));
+    const size_t fixed = base + (size_t(src_width) * src_height + size_t(dst_width) * dst_height * (direct ? 1 : 2)) * sizeof(uint32_t) + DISTANCE_LUT_BYTES;
+    const size_t avail = iMaxMemory > fixed ? iMaxMemory - fixed : 0;
+    threads = std::max<size_t>(1, std::min(threads, spriteBytes ? avail / spriteBytes : threads));
+  }
+
+  if(bEnableOutput)printf("Scaling %zu sprites on %zu threads...\n", sprites.size(), std::min(threads, groups.size()));
+
+  //padding between sprites is not part of any sprite: plain copy
+  xbrz::nearestNeighborScale(in_data, src_width, src_height, dest, dst_width, dst_height);
+
+  //each sprite sees transparent pixels beyond its border, exactly like a standalone image: no color bleeding between neighbors
+  std::atomic<bool> failed(false);
+  parallelFor(groups.size(), [&](size_t g) {
+    for(size_t i : groups[g]) {
+      const SDL_Rect& r = sprites[i];
+      std::vector<uint32_t> sprite(size_t(r.w) * r.h);
+      std::vector<uint32_t> scaled(size_t(r.w) * scale * r.h * scale);
+
+      for(int y = 0; y < r.h; y++)
+        std::copy_n(in_data + size_t(r.y + y) * src_width + r.x, r.w, sprite.data() + size_t(y) * r.w);
+
+      if(!scaleBuffer(scale, sprite.data(), scaled.data(), r.w, r.h)) {
+        failed = true;
+        return;
+      }
+
+      for(int y = 0; y < r.h * scale; y++)
+        std::copy_n(scaled.data() + size_t(y) * r.w * scale, r.w * scale,
+                    dest + size_t(r.y * scale + y) * dst_width + r.x * scale);
+    }
+  }, threads);
+  reportHugePages();
+  reportMemo();
+  delete [] in_data;
+  if(failed) {
+    if(!direct) delete [] dest;
+    SDL_FreeSurface(dst_img);
+    return NULL;
+  }
+
+  if(bEnableOutput)printf("Saving image...\n");
+  if(!direct) {
+    uint32toSurface(dest,dst_img);
+    delete [] dest;
+  }
 
   return dst_img;
 }
+
+bool libxbrzscale::scaleAnimation(const Animation& src, int scale, Animation& dst){
+  const int w = src.w;
+  const int h = src.h;
+  if(!checkSize(w, h, scale))
+    return false;
+
+  dst.w = w * scale;
+  dst.h = h * scale;
+  dst.loops = src.loops;
+  dst.frames.resize(src.frames.size());
+
+  //a source row influences target rows of source rows +-2 (xBRZ reads a 5x5 neighborhood)
+  const int HALO = 2;
+  size_t rowsScaled = 0;
+
+  for(size_t f = 0; f < src.frames.size(); f++) {
+    const uint32_t* in_data = src.frames[f].pixels.data();
+    std::vector<uint32_t>& dest = dst.frames[f].pixels;
+    dst.frames[f].delay = src.frames[f].delay;
+
+    //row ranges [first, last) that have to go through xBRZ again
+    std::vector<std::pair<int, int>> ranges;
+    if(f == 0) {
+      dest.resize(size_t(dst.w) * dst.h);
+      ranges.push_back(std::make_pair(0, h));
+    } else {
+      const uint32_t* prev = src.frames[f - 1].pixels.data();
+      dest = dst.frames[f - 1].pixels;
+      for(int y = 0; y < h; y++) {
+        if(memcmp(in_data + size_t(y) * w, prev + size_t(y) * w, w * sizeof(uint32_t)) == 0)
+          continue;
+        const int first = std::max(0, y - HALO);
+        const int last = std::min(h, y + HALO + 1);
+        if(!ranges.empty() && first <= ranges.back().second)
+          ranges.back().second = last;
+        else
+          ranges.push_back(std::make_pair(first, last));
+      }
+    }
+
+    //cut long ranges into stripes so the threads have something to share
+    const int stripeHeight = std::max(16, h / getThreadCount());
+    std::vector<std::pair<int, int>> stripes;
+    for(const std::pair<int, int>& r : ranges) {
+      for(int y = r.first; y < r.second; y += stripeHeight)
+        stripes.push_back(std::make_pair(y, std::min(r.second, y + stripeHeight)));
+      rowsScaled += r.second - r.first;
+    }
+
+    //same result as ARGB, but skips the alpha weighting wherever both pixels are opaque
+    const xbrz::ColorFormat colFmt = isOpaque(in_data, size_t(w) * h) ? xbrz::ColorFormat::ARGB_OPAQUE : xbrz::ColorFormat::ARGB;
+    parallelFor(stripes.size(), [&](size_t i) {
+      xbrz::scale(scale, in_data, dest.data(), w, h, colFmt, scalerCfg(), stripes[i].first, stripes[i].second);
+    });
+  }
+
+  if(bEnableOutput)printf("Scaled %zu frames, rescaled %zu of %zu source rows\n", src.frames.size(), rowsScaled, src.frames.size() * h);
+  return true;
+}
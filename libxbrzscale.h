@@ -16,9 +16,87 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <SDL2/SDL_rect.h>
 #include <SDL2/SDL_stdinc.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "animation.h"
 
 struct SDL_Surface;
+namespace xbrz { struct ScalerCfg; }
+
+/*
+ * Handle of a scale running in the background, see libxbrzscale::scaleAsync(). Destroying it cancels the scale and frees its result
+ * unless get() has taken it.
+ */
+class ScaleJob
+{
+ public:
+  ~ScaleJob();
+  // the scaled image, owned by the caller; waits for it if need be. NULL if cancelled or failed. Only once.
+  SDL_Surface* get(){return result.get();};
+  bool isDone() const{return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;};
+  // stops before the next stripe: at most one stripe per thread is still scaled after this
+  void cancel(){cancelled=true;};
+  bool isCancelled() const{return cancelled;};
+  int stripesDone() const{return done;};
+  int stripeCount() const{return total;};
+ private:
+  friend class libxbrzscale;
+  std::future<SDL_Surface*> result;
+  std::atomic<bool> cancelled{false};
+  std::atomic<int> done{0};
+  std::atomic<int> total{0};
+};
+
+/*
+ * Timing of the frames of a FrameScaler so far.
+ */
+struct FrameStats
+{
+  uint64_t frames = 0;
+  uint64_t fallbackFrames = 0; // frames that showed at least one stripe in nearest neighbor because the deadline came first
+  uint64_t overruns = 0;       // frames that returned after their deadline: a single stripe took longer than predicted
+  double lastMs = 0;
+  double maxMs = 0;
+  double totalMs = 0;
+  int lastScaled = 0;   // xBRZ stripes of the last frame
+  int lastFallback = 0; // nearest neighbor stripes of the last frame
+  int pending = 0;      // stripes currently shown in nearest neighbor, refined on the next frames
+};
+
+/*
+ * Scales a stream of equally sized frames (e.g. an emulator's output) within a time budget per frame. Only stripes whose source rows changed
+ * are scaled again, the ones that changed first, then those left in nearest neighbor by earlier frames. A stripe is only started if it is
+ * expected to be done before the deadline; the changed stripes left at the deadline are filled by nearest neighbor and refined by the next
+ * frames, as long as their source stays the same. Not thread-safe: one thread feeds the frames, the scaler uses libxbrzscale's worker threads.
+ */
+class FrameScaler
+{
+ public:
+  FrameScaler(int w, int h, int scale);
+  // "frame": w * h ARGB pixels; returns the (w * scale) * (h * scale) result, valid until the next call
+  const uint32_t* scaleFrame(const uint32_t* frame, std::chrono::steady_clock::time_point deadline);
+  const uint32_t* output() const{return dest.data();};
+  const FrameStats& getStats() const{return stats;};
+ private:
+  enum StripeState { STALE, NEAREST, SCALED };
+  int width;
+  int height;
+  int factor;
+  int stripeRows;
+  std::vector<uint32_t> prev;
+  std::vector<uint32_t> dest;
+  std::vector<StripeState> stripes;
+  std::vector<double> stripeSeconds; // recent times to scale one stripe: their median predicts the next one
+  size_t nextSample;
+  FrameStats stats;
+};
 
 class libxbrzscale
 {
@@ -27,9 +105,53 @@ class libxbrzscale
   static inline void SDL_PutPixel(SDL_Surface *surface, int x, int y, Uint32 pixel);
   static SDL_Surface* createARGBSurface(int w, int h);
   static SDL_Surface* scale(SDL_Surface* src_img,int scale);
+  static bool scaleToPNG(SDL_Surface* src_img, int scale, const char* out_file);
+  // our own PNG encoder on an ARGB surface, deflating chunks of rows on "threads" threads (default: all); IMG_SavePNG() for other surfaces
+  static bool savePNG(SDL_Surface* img, const char* out_file, int threads = 0);
+  // like scale() (without the upscale detection), but returns at once; "progress" is called after each finished stripe, from the worker threads but never concurrently
+  static std::unique_ptr<ScaleJob> scaleAsync(SDL_Surface* src_img, int scale, const std::function<void(int done, int total)>& progress = nullptr);
+  static bool scaleMulti(SDL_Surface* src_img, const std::vector<int>& scales, std::vector<SDL_Surface*>& dst_imgs);
+  static SDL_Surface* scaleAtlas(SDL_Surface* src_img, int scale, const std::vector<SDL_Rect>& rects);
+  static bool scaleAnimation(const Animation& src, int scale, Animation& dst);
+  // xBRZ on ARGB pixels the caller already has, in stripes on all threads; no upscale detection, no output
+  static void scaleParallel(int scale, const uint32_t* src, uint32_t* dst, int width, int height);
   static void setEnableOutput(bool b){bEnableOutput=true;};
+  static void setSkipTransparent(bool b){bSkipTransparent=b;};
+  static void setThreadCount(int n){iThreadCount=n;};
+  // for the calling thread only: its scale calls use at most n threads (0: no limit); for pools that already run one job per thread
+  static void setThreadLimit(int n){iThreadLimit=n;};
+  static void setMaxMemory(size_t bytes){iMaxMemory=bytes;};
+  static void setDetectUpscaled(bool b){bDetectUpscaled=b;};
+  static void setHugePages(bool b){bHugePages=b;};
+  static void setShareDistanceTable(bool b);
+  static void setMemoize(bool b){bMemoize=b;};
+  static void setPipeline(bool b){bPipeline=b;};
+  static size_t getPeakMemory();
+  static size_t getHugePageMemory();
+  static int getThreadCount();
   static uint32_t* surfaceToUint32(SDL_Surface* img);
+  static bool isOpaque(const uint32_t* data, size_t count);
+  static int pixelSize(const uint32_t* data, int width, int height);
   static void uint32toSurface(uint32_t* dest, SDL_Surface* dst_img);
  private:
+  friend class FrameScaler;
   static bool bEnableOutput;
+  static bool bSkipTransparent;
+  static int iThreadCount;
+  static thread_local int iThreadLimit;
+  static size_t iMaxMemory;
+  static bool bDetectUpscaled;
+  static bool bHugePages;
+  static bool bMemoize;
+  static bool bPipeline;
+  static bool checkSize(int src_width, int src_height, int scale);
+  static void parallelFor(size_t count, const std::function<void(size_t)>& fn, size_t maxThreads = 0);
+  static uint32_t* surfacePixels(SDL_Surface* img);
+  static void adviseHugePages(void* data, size_t bytes);
+  static void reportHugePages();
+  static void reportMemo();
+  static xbrz::ScalerCfg scalerCfg();
+  // returns the detected pixel size (1 if not upscaled), 0 if there was not enough memory
+  static int scaleBuffer(int scale, const uint32_t* src, uint32_t* dst, int width, int height, bool pipelined = false);
+  static void scaleXbrz(int scale, const uint32_t* src, uint32_t* dst, int width, int height, bool pipelined = false);
 };
@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2014 Przemysław Grzywacz <nexather@gmail.com>
+ * This file is part of xbrzscale.
+ *
+ * xbrzscale is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pngwriter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+
+const unsigned char PNG_SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+const size_t MAX_CHUNK_DATA = 1 << 30;
+const size_t IDAT_BUFFER_SIZE = 256 * 1024;
+//deflate's window: what each parallel chunk is primed with
+const size_t DICTIONARY_SIZE = 32 * 1024;
+//smallest chunk of filtered bytes worth a thread of its own
+const size_t MIN_PARALLEL_CHUNK = 1 << 20;
+//bytes FILTER_ADAPTIVE filters before it checks whether a candidate can still win
+const size_t ADAPTIVE_BLOCK = 1024;
+
+void putU32(std::string& s, uint32_t v){
+  s += static_cast<char>(v >> 24);
+  s += static_cast<char>(v >> 16);
+  s += static_cast<char>(v >> 8);
+  s += static_cast<char>(v);
+}
+
+void putU16(std::string& s, uint16_t v){
+  s += static_cast<char>(v >> 8);
+  s += static_cast<char>(v);
+}
+
+std::string ihdrData(int w, int h){
+  std::string ihdr;
+  putU32(ihdr, w);
+  putU32(ihdr, h);
+  ihdr += '\x08'; // bit depth
+  ihdr += '\x06'; // RGBA
+  ihdr += std::string(3, '\0'); // deflate, adaptive filtering, no interlace
+  return ihdr;
+}
+
+void toRGBA(const uint32_t* p, int w, char* out){
+  for (int x = 0; x < w; x++, out += 4) {
+    out[0] = static_cast<char>(p[x] >> 16);
+    out[1] = static_cast<char>(p[x] >> 8);
+    out[2] = static_cast<char>(p[x]);
+    out[3] = static_cast<char>(p[x] >> 24);
+  }
+}
+
+unsigned char paeth(int a, int b, int c){
+  const int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+  return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// one filter type on bytes [from, to) of a row of RGBA bytes; the first pixel has no left neighbour
+void filterBytes(int type, const unsigned char* cur, const unsigned char* prev, size_t from, size_t to, unsigned char* out){
+  size_t i = from;
+  switch (type) {
+  case 0:
+    memcpy(out + from, cur + from, to - from);
+    break;
+  case 1:
+    for (; i < to && i < 4; i++)
+      out[i] = cur[i];
+    for (; i < to; i++)
+      out[i] = cur[i] - cur[i - 4];
+    break;
+  case 2:
+    for (; i < to; i++)
+      out[i] = cur[i] - prev[i];
+    break;
+  case 3:
+    for (; i < to && i < 4; i++)
+      out[i] = cur[i] - (prev[i] >> 1);
+    for (; i < to; i++)
+      out[i] = cur[i] - ((cur[i - 4] + prev[i]) >> 1);
+    break;
+  default:
+    for (; i < to && i < 4; i++)
+      out[i] = cur[i] - prev[i];
+    for (; i < to; i++)
+      out[i] = cur[i] - paeth(cur[i - 4], prev[i], prev[i - 4]);
+    break;
+  }
+}
+
+// prev is the previous row unfiltered, all zeros above the first; out gets the filter type and the filtered bytes, scratch is for FILTER_ADAPTIVE
+void filterRow(pngwriter::Filter filter, const std::string& cur, const std::string& prev, std::string& out, std::string& scratch){
+  const unsigned char* c = reinterpret_cast<const unsigned char*>(cur.data());
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(prev.data());
+  if (filter != pngwriter::FILTER_ADAPTIVE) {
+    out[0] = filter;
+    filterBytes(filter, c, p, 0, cur.size(), reinterpret_cast<unsigned char*>(&out[1]));
+    return;
+  }
+  //the bytes as signed values: small sums mean runs of small differences, which deflate well; a candidate is dropped as soon as its
+  //sum so far exceeds the best one
+  unsigned long best = ULONG_MAX;
+  scratch.resize(out.size());
+  for (int type = 0; type < 5; type++) {
+    unsigned char* s = reinterpret_cast<unsigned char*>(&scratch[0]);
+    s[0] = type;
+    unsigned long sum = 0;
+    for (size_t from = 0; from < cur.size() && sum < best; from += ADAPTIVE_BLOCK) {
+      const size_t to = std::min(cur.size(), from + ADAPTIVE_BLOCK);
+      filterBytes(type, c, p, from, to, s + 1);
+      for (size_t i = from; i < to; i++)
+        sum += abs(static_cast<signed char>(s[1 + i]));
+    }
+    if (sum < best) {
+      best = sum;
+      out.swap(scratch);
+    }
+  }
+}
+
+bool writeChunk(FILE* f, const char* type, const std::string& data){
+  std::string chunk;
+  putU32(chunk, data.size());
+  chunk.append(type, 4);
+  chunk += data;
+  putU32(chunk, crc32(0, reinterpret_cast<const Bytef*>(chunk.data() + 4), data.size() + 4));
+  return fwrite(chunk.data(), 1, chunk.size(), f) == chunk.size();
+}
+
+}
+
+int pngwriter::compressionLevel = Z_DEFAULT_COMPRESSION;
+pngwriter::Filter pngwriter::filterType = pngwriter::FILTER_NONE;
+
+pngwriter::pngwriter() : f(NULL), zs(NULL), width(0), rowsLeft(0), ok(false){
+}
+
+pngwriter::~pngwriter(){
+  if (zs) {
+    deflateEnd(zs);
+    delete zs;
+  }
+  if (f)
+    fclose(f);
+}
+
+bool pngwriter::open(const char* file, int w, int h){
+  f = fopen(file, "wb");
+  if (!f) {
+    fprintf(stderr, "Failed to open '%s' for writing\n", file);
+    return false;
+  }
+  zs = new z_stream();
+  ok = deflateInit(zs, compressionLevel) == Z_OK;
+  width = w;
+  rowsLeft = h;
+  row.resize(size_t(w) * 4 + 1);
+  cur.resize(size_t(w) * 4);
+  prev.assign(size_t(w) * 4, '\0');
+  zbuf.resize(IDAT_BUFFER_SIZE);
+  zs->next_out = reinterpret_cast<Bytef*>(&zbuf[0]);
+  zs->avail_out = zbuf.size();
+
+  ok = ok && fwrite(PNG_SIGNATURE, 1, 8, f) == 8 && writeChunk(f, "IHDR", ihdrData(w, h));
+  return ok;
+}
+
+bool pngwriter::deflateRow(int flush){
+  zs->next_in = reinterpret_cast<Bytef*>(&row[0]);
+  zs->avail_in = flush == Z_FINISH ? 0 : row.size();
+  for (;;) {
+    const int ret = deflate(zs, flush);
+    if (ret == Z_STREAM_ERROR)
+      return false;
+    //one IDAT chunk per full buffer
+    if (zs->avail_out == 0 || (flush == Z_FINISH && zs->avail_out < zbuf.size())) {
+      if (!writeChunk(f, "IDAT", zbuf.substr(0, zbuf.size() - zs->avail_out)))
+        return false;
+      zs->next_out = reinterpret_cast<Bytef*>(&zbuf[0]);
+      zs->avail_out = zbuf.size();
+    }
+    if (flush == Z_FINISH ? ret == Z_STREAM_END : zs->avail_in == 0)
+      return true;
+  }
+}
+
+bool pngwriter::writeRows(const uint32_t* pixels, int rows){
+  for (int y = 0; ok && y < rows && rowsLeft > 0; y++, rowsLeft--) {
+    toRGBA(pixels + size_t(y) * width, width, &cur[0]);
+    filterRow(filterType, cur, prev, row, scratch);
+    cur.swap(prev);
+    ok = deflateRow(Z_NO_FLUSH);
+  }
+  return ok;
+}
+
+bool pngwriter::close(){
+  if (!f)
+    return false;
+  ok = ok && rowsLeft == 0 && deflateRow(Z_FINISH) && writeChunk(f, "IEND", std::string());
+  ok = fclose(f) == 0 && ok;
+  f = NULL;
+  if (!ok)
+    fprintf(stderr, "Failed to write PNG\n");
+  return ok;
+}
+
+bool pngwriter::save(const char* file, const uint32_t* pixels, int w, int h, int threads){
+  const size_t rowBytes = size_t(w) * 4;
+  const size_t filteredBytes = (rowBytes + 1) * h;
+  const int chunks = int(std::max<size_t>(1, std::min<size_t>(std::max(threads, 1), filteredBytes / MIN_PARALLEL_CHUNK)));
+  const int chunkRows = (h + chunks - 1) / chunks;
+
+  //each chunk is a piece of one raw deflate stream: a sync flush ends all but the last on a byte boundary, so they can be concatenated
+  std::vector<std::string> parts(chunks);
+  std::vector<uLong> adlers(chunks);
+  std::vector<size_t> lengths(chunks);
+  std::atomic<int> next(0);
+  std::atomic<bool> failed(false);
+  auto worker = [&]() {
+    for (int c; (c = next++) < chunks;) {
+      const int yFirst = c * chunkRows;
+      const int yLast = std::min(h, yFirst + chunkRows);
+      z_stream zs = z_stream();
+      if (deflateInit2(&zs, compressionLevel, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        failed = true;
+        return;
+      }
+      std::string cur(rowBytes, '\0'), prev(cur), filtered(rowBytes + 1, '\0'), scratch;
+
+      //the rows before the chunk, filtered again: the deflater starts with the window the previous chunk ends with
+      if (yFirst > 0) {
+        const int dictFirst = std::max(0, yFirst - int((DICTIONARY_SIZE + rowBytes) / (rowBytes + 1)));
+        if (dictFirst > 0)
+          toRGBA(pixels + size_t(dictFirst - 1) * w, w, &prev[0]);
+        std::string dict;
+        for (int y = dictFirst; y < yFirst; y++) {
+          toRGBA(pixels + size_t(y) * w, w, &cur[0]);
+          filterRow(filterType, cur, prev, filtered, scratch);
+          cur.swap(prev);
+          dict += filtered;
+        }
+        const size_t keep = std::min(dict.size(), DICTIONARY_SIZE);
+        deflateSetDictionary(&zs, reinterpret_cast<const Bytef*>(dict.data() + dict.size() - keep), keep);
+      }
+
+      const bool last = yLast == h;
+      std::string& out = parts[c];
+      out.resize(deflateBound(&zs, (rowBytes + 1) * (yLast - yFirst)) + 16); //a sync flush adds 5 bytes
+      zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+      zs.avail_out = out.size();
+      uLong adler = adler32(0, NULL, 0);
+      bool ok = true;
+      for (int y = yFirst; ok && y < yLast; y++) {
+        toRGBA(pixels + size_t(y) * w, w, &cur[0]);
+        filterRow(filterType, cur, prev, filtered, scratch);
+        cur.swap(prev);
+        adler = adler32(adler, reinterpret_cast<const Bytef*>(filtered.data()), filtered.size());
+        zs.next_in = reinterpret_cast<Bytef*>(&filtered[0]);
+        zs.avail_in = filtered.size();
+        ok = deflate(&zs, Z_NO_FLUSH) == Z_OK && zs.avail_in == 0;
+      }
+      ok = ok && deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH) == (last ? Z_STREAM_END : Z_OK);
+      out.resize(zs.total_out);
+      deflateEnd(&zs);
+      adlers[c] = adler;
+      lengths[c] = (rowBytes + 1) * (yLast - yFirst);
+      if (!ok)
+        failed = true;
+    }
+  };
+  std::vector<std::thread> pool;
+  for (int t = 1; t < std::min(threads, chunks); t++)
+    pool.emplace_back(worker);
+  worker();
+  for (std::thread& t : pool)
+    t.join();
+
+  //zlib header and checksum around the pieces, with the level in the header as deflate() would put it
+  const int level = compressionLevel == Z_DEFAULT_COMPRESSION ? 6 : compressionLevel;
+  const int levelFlags = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+  std::string data;
+  data += '\x78';
+  data += static_cast<char>((levelFlags << 6) + 31 - ((0x78 << 8) + (levelFlags << 6)) % 31);
+  uLong adler = adler32(0, NULL, 0);
+  for (int c = 0; c < chunks; c++) {
+    adler = adler32_combine(adler, adlers[c], lengths[c]);
+    data += parts[c];
+    std::string().swap(parts[c]);
+  }
+  putU32(data, adler);
+
+  FILE* f = fopen(file, "wb");
+  if (!f) {
+    fprintf(stderr, "Failed to open '%s' for writing\n", file);
+    return false;
+  }
+  bool ok = !failed && fwrite(PNG_SIGNATURE, 1, 8, f) == 8 && writeChunk(f, "IHDR", ihdrData(w, h));
+  for (size_t pos = 0; ok && pos < data.size(); pos += MAX_CHUNK_DATA)
+    ok = writeChunk(f, "IDAT", data.substr(pos, MAX_CHUNK_DATA));
+  ok = ok && writeChunk(f, "IEND", std::string());
+  ok = fclose(f) == 0 && ok;
+  if (!ok)
+    fprintf(stderr, "Failed to write '%s'\n", file);
+  return ok;
+}
+
+bool pngwriter::compressRect(const uint32_t* pixels, int stride, int x, int y, int w, int h, std::string& out){
+  std::string raw, cur(size_t(w) * 4, '\0'), prev(cur), filtered(cur.size() + 1, '\0'), scratch;
+  raw.reserve(filtered.size() * h);
+  for (int row = y; row < y + h; row++) {
+    toRGBA(pixels + size_t(row) * stride + x, w, &cur[0]);
+    filterRow(filterType, cur, prev, filtered, scratch);
+    cur.swap(prev);
+    raw += filtered;
+  }
+
+  uLongf size = compressBound(raw.size());
+  out.resize(size);
+  if (compress2(reinterpret_cast<Bytef*>(&out[0]), &size, reinterpret_cast<const Bytef*>(raw.data()), raw.size(), compressionLevel) != Z_OK)
+    return false;
+  out.resize(size);
+  return true;
+}
+
+bool pngwriter::saveAPNG(const char* file, const Animation& anim){
+  FILE* f = fopen(file, "wb");
+  if (!f) {
+    fprintf(stderr, "Failed to open '%s' for writing\n", file);
+    return false;
+  }
+
+  bool ok = fwrite(PNG_SIGNATURE, 1, 8, f) == 8;
+  ok = ok && writeChunk(f, "IHDR", ihdrData(anim.w, anim.h));
+
+  std::string actl;
+  putU32(actl, anim.frames.size());
+  putU32(actl, anim.loops);
+  ok = ok && writeChunk(f, "acTL", actl);
+
+  uint32_t sequence = 0;
+  for (size_t i = 0; ok && i < anim.frames.size(); i++) {
+    const uint32_t* pixels = anim.frames[i].pixels.data();
+
+    //bounding box of what changed since the previous frame; the first frame must cover the canvas
+    int x0 = 0, y0 = 0, x1 = anim.w, y1 = anim.h;
+    if (i > 0) {
+      const uint32_t* prev = anim.frames[i - 1].pixels.data();
+      x0 = anim.w; y0 = anim.h; x1 = 0; y1 = 0;
+      for (int y = 0; y < anim.h; y++) {
+        const uint32_t* a = pixels + size_t(y) * anim.w;
+        const uint32_t* b = prev + size_t(y) * anim.w;
+        if (memcmp(a, b, anim.w * sizeof(uint32_t)) == 0)
+          continue;
+        int first = 0, last = anim.w;
+        while (a[first] == b[first]) first++;
+        while (a[last - 1] == b[last - 1]) last--;
+        x0 = std::min(x0, first);
+        x1 = std::max(x1, last);
+        y0 = std::min(y0, y);
+        y1 = y + 1;
+      }
+      if (x1 <= x0) { // identical frame: keep a single unchanged pixel
+        x0 = y0 = 0;
+        x1 = y1 = 1;
+      }
+    }
+
+    std::string fctl;
+    putU32(fctl, sequence++);
+    putU32(fctl, x1 - x0);
+    putU32(fctl, y1 - y0);
+    putU32(fctl, x0);
+    putU32(fctl, y0);
+    putU16(fctl, std::min(anim.frames[i].delay, 65535));
+    putU16(fctl, 1000);
+    fctl += '\0'; // APNG_DISPOSE_OP_NONE
+    fctl += '\0'; // APNG_BLEND_OP_SOURCE
+    ok = ok && writeChunk(f, "fcTL", fctl);
+
+    std::string data;
+    ok = ok && compressRect(pixels, anim.w, x0, y0, x1 - x0, y1 - y0, data);
+    //chunk lengths are limited to 2^31 - 1: huge frames are split over several IDAT/fdAT chunks
+    for (size_t pos = 0; ok && pos < data.size(); pos += MAX_CHUNK_DATA) {
+      const std::string part = data.substr(pos, MAX_CHUNK_DATA);
+      if (i == 0) {
+        ok = writeChunk(f, "IDAT", part);
+      } else {
+        std::string fdat;
+        putU32(fdat, sequence++);
+        ok = writeChunk(f, "fdAT", fdat + part);
+      }
+    }
+  }
+
+  ok = ok && writeChunk(f, "IEND", std::string());
+  ok = fclose(f) == 0 && ok;
+  if (!ok)
+    fprintf(stderr, "Failed to write '%s'\n", file);
+  return ok;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2014 Przemysław Grzywacz <nexather@gmail.com>
+ * This file is part of xbrzscale.
+ *
+ * xbrzscale is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "animation.h"
+
+struct z_stream_s;
+
+/*
+ * PNG output straight from xBRZ's ARGB buffers, written as 8 bit RGBA.
+ */
+class pngwriter
+{
+ public:
+  // PNG row filters; ADAPTIVE picks the one with the smallest sum of absolute differences for each row, like libpng does
+  enum Filter { FILTER_NONE, FILTER_SUB, FILTER_UP, FILTER_AVERAGE, FILTER_PAETH, FILTER_ADAPTIVE };
+  // for all PNGs written from then on; level is zlib's, 0 - 9 or Z_DEFAULT_COMPRESSION (-1)
+  static void setCompression(int level){compressionLevel=level;};
+  static void setFilter(Filter filter){filterType=filter;};
+  pngwriter();
+  ~pngwriter();
+  // still image written while it is produced: open(), all rows top to bottom in any number of writeRows() calls, close()
+  bool open(const char* file, int w, int h);
+  bool writeRows(const uint32_t* pixels, int rows);
+  bool close();
+  // still image from a complete buffer: chunks of rows are filtered and deflated on up to "threads" threads, each chunk ends on a byte
+  // boundary and is primed with the last 32 KB before it, so the pieces form a single zlib stream
+  static bool save(const char* file, const uint32_t* pixels, int w, int h, int threads);
+  // animated PNG; every frame after the first only stores the rectangle that changed
+  static bool saveAPNG(const char* file, const Animation& anim);
+ private:
+  static int compressionLevel;
+  static Filter filterType;
+  FILE* f;
+  z_stream_s* zs;
+  int width;
+  int rowsLeft;
+  bool ok;
+  std::string row; // filter type and filtered bytes
+  std::string cur; // RGBA bytes of the current and the previous row
+  std::string prev;
+  std::string scratch; // FILTER_ADAPTIVE's candidates
+  std::string zbuf;
+  bool deflateRow(int flush);
+  static bool compressRect(const uint32_t* pixels, int stride, int x, int y, int w, int h, std::string& out);
+};
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2014 Przemysław Grzywacz <nexather@gmail.com>
+ * This file is part of xbrzscale.
+ *
+ * xbrzscale is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares the fixed-point distance policy (xbrz::ColorFormat::ARGB_FIXED) with the floating point one (ARGB): the blend decisions
+ * every 4x4 kernel makes, the equal color test between neighbors and the scaled pixels at all factors. Takes images to compare on, or
+ * uses a built-in set of synthetic ones (pixel art, sprite, noise, photo-like) if there are none.
+ */
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "libxbrzscale.h"
+#include "xbrz/xbrz.h"
+
+namespace {
+
+struct TestImage
+{
+  std::string name;
+  int width;
+  int height;
+  std::vector<uint32_t> pixels;
+};
+
+struct Counts
+{
+  uint64_t kernels = 0;
+  uint64_t decisions = 0; // kernels whose corner blend decisions differ
+  uint64_t pairs = 0;
+  uint64_t equalTests = 0; // neighbor pairs the equal color test decides differently
+  uint64_t pixels = 0;
+  uint64_t pixelDiffs = 0; // scaled pixels that differ, over all factors
+
+  void add(const Counts& c)
+  {
+    kernels += c.kernels;
+    decisions += c.decisions;
+    pairs += c.pairs;
+    equalTests += c.equalTests;
+    pixels += c.pixels;
+    pixelDiffs += c.pixelDiffs;
+  }
+};
+
+const int SYNTHETIC_SIZE = 512;
+
+uint32_t nextRandom(uint32_t& state)
+{
+  state = state * 1664525 + 1013904223;
+  return state;
+}
+
+TestImage synthetic(int kind)
+{
+  static const char* const names[] = { "pixel art", "sprite", "noise", "photo" };
+  TestImage img = { names[kind], SYNTHETIC_SIZE, SYNTHETIC_SIZE, std::vector<uint32_t>(SYNTHETIC_SIZE * SYNTHETIC_SIZE) };
+
+  uint32_t state = 1234 + kind;
+  uint32_t palette[8];
+  for (uint32_t& col : palette)
+    col = nextRandom(state) | 0xff000000;
+  palette[1] = 0x80ff0000; // one half transparent color
+
+  for (int y = 0; y < img.height; y++)
+    for (int x = 0; x < img.width; x++) {
+      uint32_t& pix = img.pixels[y * img.width + x];
+      switch (kind) {
+        case 0:
+          pix = palette[((x / 3) * 7 + (y / 4) * 3 + (x * y) / 17) % 8];
+          break;
+        case 1: // opaque figure on a transparent background
+          pix = x > img.width / 3 && x < img.width / 2 && y > img.height / 4 && y < img.height / 2 ? palette[2 + (x + y / 2) % 5] : 0;
+          break;
+        case 2:
+          pix = nextRandom(state);
+          break;
+        default: // photo-like: smooth gradients with a little noise, close colors everywhere, where rounding matters most
+        {
+          const uint32_t noise = nextRandom(state);
+          const int r = x * 224 / img.width + (noise & 0x1f);
+          const int g = y * 224 / img.height + (noise >> 8 & 0x1f);
+          const int b = (x + y) * 112 / img.width + (noise >> 16 & 0x1f);
+          pix = 0xff000000 | r << 16 | g << 8 | b;
+          break;
+        }
+      }
+    }
+  return img;
+}
+
+bool load(const char* file, TestImage& img)
+{
+  SDL_Surface* surface = IMG_Load(file);
+  if (!surface) {
+    fprintf(stderr, "Failed to load '%s': %s\n", file, IMG_GetError());
+    return false;
+  }
+  uint32_t* data = libxbrzscale::surfaceToUint32(surface);
+  img.name = file;
+  img.width = surface->w;
+  img.height = surface->h;
+  SDL_FreeSurface(surface);
+  if (!data) {
+    fprintf(stderr, "Not enough memory for '%s'\n", file);
+    return false;
+  }
+  img.pixels.assign(data, data + size_t(img.width) * img.height);
+  delete [] data;
+  return true;
+}
+
+Counts compare(const TestImage& img)
+{
+  const xbrz::ScalerCfg cfg;
+  const size_t count = img.pixels.size();
+  const uint32_t* src = img.pixels.data();
+  Counts c;
+
+  // one blend map entry per pixel: the corners its 4x4 kernel decided to blend
+  std::vector<unsigned char> blendFloat(count), blendFixed(count);
+  xbrz::computeBlendMap(src, blendFloat.data(), img.width, img.height, xbrz::ColorFormat::ARGB, cfg);
+  xbrz::computeBlendMap(src, blendFixed.data(), img.width, img.height, xbrz::ColorFormat::ARGB_FIXED, cfg);
+  c.kernels = count;
+  for (size_t i = 0; i < count; i++)
+    if (blendFloat[i] != blendFixed[i])
+      c.decisions++;
+
+  for (int y = 0; y < img.height; y++)
+    for (int x = 0; x < img.width; x++) {
+      const uint32_t pix = src[y * img.width + x];
+      const uint32_t neighbors[] = { x + 1 < img.width ? src[y * img.width + x + 1] : pix, y + 1 < img.height ? src[(y + 1) * img.width + x] : pix };
+      for (uint32_t other : neighbors) {
+        c.pairs++;
+        if (xbrz::equalColorTest(pix, other, xbrz::ColorFormat::ARGB, cfg.luminanceWeight, cfg.equalColorTolerance) !=
+            xbrz::equalColorTest(pix, other, xbrz::ColorFormat::ARGB_FIXED, cfg.luminanceWeight, cfg.equalColorTolerance))
+          c.equalTests++;
+      }
+    }
+
+  for (size_t factor = 2; factor <= xbrz::SCALE_FACTOR_MAX; factor++) {
+    std::vector<uint32_t> trgFloat(count * factor * factor), trgFixed(count * factor * factor);
+    xbrz::scale(factor, src, trgFloat.data(), img.width, img.height, xbrz::ColorFormat::ARGB, cfg);
+    xbrz::scale(factor, src, trgFixed.data(), img.width, img.height, xbrz::ColorFormat::ARGB_FIXED, cfg);
+    c.pixels += trgFloat.size();
+    for (size_t i = 0; i < trgFloat.size(); i++)
+      if (trgFloat[i] != trgFixed[i])
+        c.pixelDiffs++;
+  }
+  return c;
+}
+
+double percent(uint64_t part, uint64_t total)
+{
+  return total ? 100.0 * part / total : 0;
+}
+
+void report(const char* name, const Counts& c)
+{
+  printf("%-20s decisions %llu/%llu (%.4f%%), equal tests %llu/%llu (%.4f%%), pixels %llu/%llu (%.4f%%)\n", name,
+         (unsigned long long)c.decisions, (unsigned long long)c.kernels, percent(c.decisions, c.kernels),
+         (unsigned long long)c.equalTests, (unsigned long long)c.pairs, percent(c.equalTests, c.pairs),
+         (unsigned long long)c.pixelDiffs, (unsigned long long)c.pixels, percent(c.pixelDiffs, c.pixels));
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1 && argv[1][0] == '-') {
+    fprintf(stderr, "usage: policycmp [image ...]\n");
+    fprintf(stderr, "Compares the ARGB_FIXED distance policy with ARGB on the images, or on built-in synthetic ones\n");
+    return 1;
+  }
+
+  if (argc > 1 && SDL_Init(SDL_INIT_VIDEO) != 0) {
+    fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
+    return 1;
+  }
+
+  Counts total;
+  const int images = argc > 1 ? argc - 1 : 4;
+  for (int i = 0; i < images; i++) {
+    TestImage img;
+    if (argc > 1) {
+      if (!load(argv[i + 1], img))
+        return 1;
+    } else
+      img = synthetic(i);
+
+    const Counts c = compare(img);
+    report(img.name.c_str(), c);
+    total.add(c);
+  }
+  report("total", total);
+
+  if (argc > 1)
+    SDL_Quit();
+  return 0;
+}
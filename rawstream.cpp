@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2014 Przemysław Grzywacz <nexather@gmail.com>
+ * This file is part of xbrzscale.
+ *
+ * xbrzscale is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rawstream.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "libxbrzscale.h"
+#include "xbrz/xbrz.h"
+
+namespace {
+
+//frames in flight: one being read, one scaled, one written
+const int RING_SLOTS = 3;
+//stdio buffers: a few large reads instead of many small ones
+const size_t IO_BUFFER_SIZE = 1 << 20;
+
+struct Slot
+{
+  std::vector<unsigned char> bytes; // frame as read or written, in the stream's format
+  std::vector<uint32_t> src;
+  std::vector<uint32_t> dst;
+};
+
+// hands slot numbers from one stage to the next; pop() returns -1 once the queue is closed and empty
+class SlotQueue
+{
+ public:
+  void push(int slot){
+    std::lock_guard<std::mutex> lock(m);
+    slots.push_back(slot);
+    changed.notify_one();
+  }
+  void close(){
+    std::lock_guard<std::mutex> lock(m);
+    closed = true;
+    changed.notify_one();
+  }
+  int pop(){
+    std::unique_lock<std::mutex> lock(m);
+    changed.wait(lock, [&] { return closed || !slots.empty(); });
+    if (slots.empty())
+      return -1;
+    const int slot = slots.front();
+    slots.pop_front();
+    return slot;
+  }
+ private:
+  std::mutex m;
+  std::condition_variable changed;
+  std::deque<int> slots;
+  bool closed = false;
+};
+
+struct PamHeader
+{
+  int width = 0;
+  int height = 0;
+  int depth = 0;
+  std::string tupleType;
+};
+
+// false at the end of the stream or on a header that is not 8 bit RGB or RGB_ALPHA
+bool readPamHeader(FILE* in, PamHeader& header, bool& eof){
+  char line[256];
+  eof = !fgets(line, sizeof(line), in);
+  if (eof || strcmp(line, "P7\n") != 0)
+    return false;
+  int maxval = 0;
+  header = PamHeader();
+  while (fgets(line, sizeof(line), in) && strcmp(line, "ENDHDR\n") != 0) {
+    char type[64];
+    if (sscanf(line, "WIDTH %d", &header.width) == 1 || sscanf(line, "HEIGHT %d", &header.height) == 1 ||
+        sscanf(line, "DEPTH %d", &header.depth) == 1 || sscanf(line, "MAXVAL %d", &maxval) == 1 || line[0] == '#')
+      continue;
+    if (sscanf(line, "TUPLTYPE %63s", type) == 1)
+      header.tupleType = type;
+    else
+      return false;
+  }
+  return header.width > 0 && header.height > 0 && maxval == 255 &&
+         ((header.depth == 4 && header.tupleType == "RGB_ALPHA") || (header.depth == 3 && header.tupleType == "RGB"));
+}
+
+void toARGB(const unsigned char* bytes, uint32_t* pixels, size_t count, rawstream::Format format, int depth){
+  for (size_t i = 0; i < count; i++, bytes += depth) {
+    if (format == rawstream::BGRA)
+      pixels[i] = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (uint32_t(bytes[3]) << 24);
+    else if (depth == 4)
+      pixels[i] = bytes[2] | (bytes[1] << 8) | (bytes[0] << 16) | (uint32_t(bytes[3]) << 24);
+    else
+      pixels[i] = bytes[2] | (bytes[1] << 8) | (bytes[0] << 16) | 0xff000000;
+  }
+}
+
+void fromARGB(const uint32_t* pixels, unsigned char* bytes, size_t count, rawstream::Format format, int depth){
+  for (size_t i = 0; i < count; i++, bytes += depth) {
+    const uint32_t p = pixels[i];
+    if (format == rawstream::BGRA) {
+      bytes[0] = p; bytes[1] = p >> 8; bytes[2] = p >> 16; bytes[3] = p >> 24;
+    } else {
+      bytes[0] = p >> 16; bytes[1] = p >> 8; bytes[2] = p;
+      if (depth == 4) bytes[3] = p >> 24;
+    }
+  }
+}
+
+}
+
+int rawstream::run(Format format, int width, int height, int scale, FILE* in, FILE* out){
+#ifdef _WIN32
+  _setmode(_fileno(in), _O_BINARY);
+  _setmode(_fileno(out), _O_BINARY);
+#endif
+  setvbuf(in, NULL, _IOFBF, IO_BUFFER_SIZE);
+  setvbuf(out, NULL, _IOFBF, IO_BUFFER_SIZE);
+
+  //the size of a PAM stream is that of its first frame
+  PamHeader pam;
+  int depth = 4;
+  if (format == PAM) {
+    bool eof;
+    if (!readPamHeader(in, pam, eof)) {
+      fprintf(stderr, eof ? "No frames on stdin\n" : "Unsupported PAM header: 8 bit RGB or RGB_ALPHA expected\n");
+      return eof ? 0 : 1;
+    }
+    width = pam.width;
+    height = pam.height;
+    depth = pam.depth;
+  }
+  if (!xbrz::canScale(scale, width, height)) {
+    fprintf(stderr, "Cannot scale %dx%d frames by %d\n", width, height, scale);
+    return 1;
+  }
+  const size_t count = size_t(width) * height;
+
+  std::vector<Slot> slots(RING_SLOTS);
+  for (Slot& slot : slots) {
+    slot.bytes.resize(count * scale * scale * depth); //large enough for input and output
+    slot.src.resize(count);
+    slot.dst.resize(count * scale * scale);
+  }
+
+  std::string outHeader;
+  if (format == PAM) {
+    char text[160];
+    snprintf(text, sizeof(text), "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+             width * scale, height * scale, depth, pam.tupleType.c_str());
+    outHeader = text;
+  }
+
+  SlotQueue freeSlots, readSlots, scaledSlots;
+  for (int i = 0; i < RING_SLOTS; i++)
+    freeSlots.push(i);
+  std::atomic<bool> failed(false);
+  bool truncated = false;
+
+  std::thread reader([&]() {
+    for (bool first = true; !failed; first = false) {
+      if (format == PAM && !first) {
+        PamHeader next;
+        bool eof;
+        if (!readPamHeader(in, next, eof)) {
+          if (!eof) {
+            fprintf(stderr, "Unsupported PAM header in the middle of the stream\n");
+            failed = true;
+          }
+          break;
+        }
+        if (next.width != width || next.height != height || next.depth != depth) {
+          fprintf(stderr, "Frame size changed from %dx%d to %dx%d\n", width, height, next.width, next.height);
+          failed = true;
+          break;
+        }
+      }
+      const int i = freeSlots.pop();
+      if (i < 0)
+        break;
+      Slot& slot = slots[i];
+      const size_t bytes = count * depth;
+      const size_t got = fread(slot.bytes.data(), 1, bytes, in);
+      if (got != bytes) {
+        truncated = got != 0 || format == PAM;
+        break;
+      }
+      toARGB(slot.bytes.data(), slot.src.data(), count, format, depth);
+      readSlots.push(i);
+    }
+    readSlots.close();
+  });
+
+  std::thread writer([&]() {
+    for (int i; (i = scaledSlots.pop()) >= 0;) {
+      Slot& slot = slots[i];
+      if (!failed) {
+        fromARGB(slot.dst.data(), slot.bytes.data(), count * scale * scale, format, depth);
+        if (fwrite(outHeader.data(), 1, outHeader.size(), out) != outHeader.size() ||
+            fwrite(slot.bytes.data(), 1, count * scale * scale * depth, out) != count * scale * scale * depth ||
+            fflush(out) != 0) {
+          fprintf(stderr, "Failed to write to stdout\n");
+          failed = true;
+        }
+      }
+      freeSlots.push(i);
+    }
+  });
+
+  typedef std::chrono::steady_clock clock;
+  const clock::time_point start = clock::now();
+  double scaleSeconds = 0;
+  int frames = 0;
+  for (int i; (i = readSlots.pop()) >= 0; frames++) {
+    const clock::time_point t0 = clock::now();
+    libxbrzscale::scaleParallel(scale, slots[i].src.data(), slots[i].dst.data(), width, height);
+    scaleSeconds += std::chrono::duration<double>(clock::now() - t0).count();
+    scaledSlots.push(i);
+  }
+  scaledSlots.close();
+  freeSlots.close(); //wakes the reader if it stopped waiting for a slot
+  reader.join();
+  writer.join();
+
+  const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+  if (truncated)
+    fprintf(stderr, "warning: incomplete last frame ignored\n");
+  fprintf(stderr, "Scaled %d frames of %dx%d in %.2f s (%.1f fps, %.1f ms scaling per frame)\n", frames, width, height, seconds,
+          seconds > 0 ? frames / seconds : 0.0, frames ? 1000 * scaleSeconds / frames : 0.0);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2014 Przemysław Grzywacz <nexather@gmail.com>
+ * This file is part of xbrzscale.
+ *
+ * xbrzscale is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RAWSTREAM_H
+#define RAWSTREAM_H
+
+#include <cstdio>
+
+/*
+ * xbrzscale --raw: scales a stream of frames from stdin to stdout, e.g. between two ffmpeg processes. Either raw frames of a fixed size,
+ * 8 bit per channel in B, G, R, A byte order (ffmpeg -pix_fmt bgra) or R, G, B, A, or a sequence of PAM images (ffmpeg -c:v pam), which
+ * are written back as PAM with the same tuple type.
+ *
+ * Reading, scaling and writing overlap: while frame N is scaled by all threads, frame N + 1 is read and frame N - 1 written. The buffers
+ * of the frames in flight are allocated once and reused.
+ */
+class rawstream
+{
+ public:
+  enum Format { BGRA, RGBA, PAM };
+  // width and height only for BGRA and RGBA; returns the exit code
+  static int run(Format format, int width, int height, int scale, FILE* in, FILE* out);
+};
+
+#endif
@@ -0,0 +1,525 @@
+/*
+ * Copyright (c) 2014 Przemysław Grzywacz <nexather@gmail.com>
+ * This file is part of xbrzscale.
+ *
+ * xbrzscale is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "server.h"
+
+#include <cstdio>
+
+#ifdef _WIN32
+
+int server::serve(const char* socketPath, size_t maxPixels){
+  fprintf(stderr, "--serve is not supported on Windows\n");
+  return 1;
+}
+
+int server::client(const char* socketPath, int argc, char** argv){
+  fprintf(stderr, "--client is not supported on Windows\n");
+  return 1;
+}
+
+#else
+
+#include <SDL2/SDL_error.h>
+#include <SDL2/SDL_image.h>
+#include <SDL2/SDL_surface.h>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "libxbrzscale.h"
+#include "xbrz/xbrz.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+//longest header line accepted from a client
+const size_t MAX_HEADER = 64 * 1024;
+//latency histogram: bucket i counts jobs that took less than 2^i ms, the last one all others
+const int LATENCY_BUCKETS = 16;
+//a client that sends or takes nothing for this long is dropped, as is one that has not sent its whole header line by then
+const int IO_TIMEOUT_SECONDS = 30;
+
+struct Job
+{
+  int fd;
+  Clock::time_point received;
+};
+
+std::mutex queueLock;
+std::condition_variable queueChanged;
+std::deque<Job> queue;
+bool stopping = false;
+//largest scaled image of one job, in pixels
+size_t maxJobPixels = 0;
+
+std::atomic<int> running(0);
+std::atomic<uint64_t> jobsDone(0);
+std::atomic<uint64_t> jobsFailed(0);
+std::atomic<uint64_t> latency[LATENCY_BUCKETS];
+
+//self-pipe: the signal handler writes to it, the accept loop polls it along with the listening socket; open until the process ends
+int stopPipe[2] = { -1, -1 };
+
+void onStopSignal(int){
+  const int savedErrno = errno;
+  const char c = 0;
+  if (write(stopPipe[1], &c, 1) < 0) {} //full: a stop is pending anyway
+  errno = savedErrno;
+}
+
+//false with errno EAGAIN or EWOULDBLOCK if the socket's timeout expired, with errno 0 if the client closed the connection
+bool readAll(int fd, void* data, size_t size){
+  char* p = static_cast<char*>(data);
+  while (size > 0) {
+    const ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0)
+      errno = 0;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool writeAll(int fd, const void* data, size_t size){
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    const ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool timedOut(){
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+//fails like readAll(), with EAGAIN as well if the line is still incomplete at "deadline": a byte now and then does not keep a worker forever
+bool readLine(int fd, std::string& line, Clock::time_point deadline){
+  line.clear();
+  char c;
+  while (readAll(fd, &c, 1)) {
+    if (c == '\n')
+      return true;
+    if (line.size() >= MAX_HEADER) {
+      errno = 0;
+      return false;
+    }
+    if (Clock::now() > deadline) {
+      errno = EAGAIN;
+      return false;
+    }
+    line += c;
+  }
+  return false;
+}
+
+std::vector<std::string> splitFields(const std::string& line){
+  std::vector<std::string> fields;
+  for (size_t pos = 0; ; ) {
+    const size_t tab = line.find('\t', pos);
+    fields.push_back(line.substr(pos, tab - pos));
+    if (tab == std::string::npos)
+      return fields;
+    pos = tab + 1;
+  }
+}
+
+bool parseInt(const std::string& s, int minValue, int maxValue, int& value){
+  char* end;
+  errno = 0;
+  const long v = strtol(s.c_str(), &end, 10);
+  if (s.empty() || *end || errno || v < minValue || v > maxValue)
+    return false;
+  value = int(v);
+  return true;
+}
+
+bool parseFormat(const std::string& name, bool& automatic, xbrz::ColorFormat& colFmt){
+  static const struct { const char* name; xbrz::ColorFormat colFmt; } formats[] = {
+    { "rgb",             xbrz::ColorFormat::RGB },
+    { "argb",            xbrz::ColorFormat::ARGB },
+    { "argb_unbuffered", xbrz::ColorFormat::ARGB_UNBUFFERED },
+    { "argb_opaque",     xbrz::ColorFormat::ARGB_OPAQUE },
+    { "argb_fixed",      xbrz::ColorFormat::ARGB_FIXED },
+    { "argb_ycbcr",      xbrz::ColorFormat::ARGB_YCBCR },
+  };
+  automatic = name == "auto";
+  if (automatic)
+    return true;
+  for (const auto& f : formats)
+    if (name == f.name) {
+      colFmt = f.colFmt;
+      return true;
+    }
+  return false;
+}
+
+bool parseSetting(const std::string& field, xbrz::ScalerCfg& cfg){
+  const size_t eq = field.find('=');
+  if (eq == std::string::npos)
+    return false;
+  const std::string name = field.substr(0, eq);
+  const char* value = field.c_str() + eq + 1;
+  char* end;
+  const double v = strtod(value, &end);
+  if (end == value || *end)
+    return false;
+  if (name == "luminanceWeight") cfg.luminanceWeight = v;
+  else if (name == "equalColorTolerance") cfg.equalColorTolerance = v;
+  else if (name == "centerDirectionBias") cfg.centerDirectionBias = v;
+  else if (name == "dominantDirectionThreshold") cfg.dominantDirectionThreshold = v;
+  else if (name == "steepDirectionThreshold") cfg.steepDirectionThreshold = v;
+  else if (name == "memoizeBlocks") cfg.memoizeBlocks = v != 0;
+  else return false;
+  return true;
+}
+
+int connectTo(const char* socketPath){
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: '%s'\n", socketPath);
+    return -1;
+  }
+  strcpy(addr.sun_path, socketPath);
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+    return fd;
+  if (fd >= 0)
+    close(fd);
+  return -1;
+}
+
+std::string absolutePath(const char* path){
+  if (path[0] == '/')
+    return path;
+  char cwd[PATH_MAX];
+  return getcwd(cwd, sizeof(cwd)) ? std::string(cwd) + "/" + path : path;
+}
+
+}
+
+//kept by each worker from job to job: pixel jobs of similar sizes do not allocate again
+struct server::Buffers
+{
+  std::vector<uint32_t> src;
+  std::vector<uint32_t> dst;
+};
+
+std::string server::scaleFile(const std::vector<std::string>& fields){
+  int scale;
+  if (fields.size() != 4 || !parseInt(fields[1], 2, 6, scale))
+    return "ERROR usage: FILE <factor 2-6> <input> <output>";
+  const Clock::time_point start = Clock::now();
+  SDL_Surface* src_img = IMG_Load(fields[2].c_str());
+  if (!src_img)
+    return std::string("ERROR failed to load '") + fields[2] + "': " + IMG_GetError();
+  if (size_t(src_img->w) * src_img->h * scale * scale > maxJobPixels) {
+    SDL_FreeSurface(src_img);
+    return "ERROR image too large";
+  }
+  SDL_Surface* dst_img = libxbrzscale::scale(src_img, scale); //frees src_img
+  if (!dst_img)
+    return "ERROR failed to scale '" + fields[2] + "'";
+  const bool saved = libxbrzscale::savePNG(dst_img, fields[3].c_str(), 1); //one thread per job
+  SDL_FreeSurface(dst_img);
+  if (!saved)
+    return "ERROR failed to write '" + fields[3] + "'";
+  char reply[64];
+  snprintf(reply, sizeof(reply), "OK %.1f", std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+  return reply;
+}
+
+std::string server::scalePixels(int fd, const std::vector<std::string>& fields, Buffers& buffers){
+  int scale, w, h;
+  if (fields.size() < 4 || !parseInt(fields[1], 2, 6, scale) || !parseInt(fields[2], 1, INT_MAX, w) || !parseInt(fields[3], 1, INT_MAX, h))
+    return "ERROR usage: PIXELS <factor 2-6> <w> <h> [<format> [<name>=<value>...]]";
+  if (!xbrz::canScale(scale, w, h) || size_t(w) * h * scale * scale > maxJobPixels)
+    return "ERROR image too large";
+
+  bool automatic = true;
+  xbrz::ColorFormat colFmt = xbrz::ColorFormat::ARGB;
+  if (fields.size() > 4 && !parseFormat(fields[4], automatic, colFmt))
+    return "ERROR unknown format '" + fields[4] + "'";
+  xbrz::ScalerCfg cfg;
+  for (size_t i = 5; i < fields.size(); i++)
+    if (!parseSetting(fields[i], cfg))
+      return "ERROR unknown setting '" + fields[i] + "'";
+
+  const size_t count = size_t(w) * h;
+  try {
+    buffers.src.resize(count);
+    buffers.dst.resize(count * scale * scale);
+  } catch (const std::bad_alloc&) {
+    //the next job starts from scratch
+    std::vector<uint32_t>().swap(buffers.src);
+    std::vector<uint32_t>().swap(buffers.dst);
+    return "ERROR out of memory";
+  }
+  if (!readAll(fd, buffers.src.data(), count * sizeof(uint32_t)))
+    return timedOut() ? "ERROR timeout" : "ERROR incomplete pixel data";
+
+  //same choice as for image files
+  if (automatic)
+    colFmt = libxbrzscale::isOpaque(buffers.src.data(), count) ? xbrz::ColorFormat::ARGB_OPAQUE : xbrz::ColorFormat::ARGB;
+  xbrz::scale(scale, buffers.src.data(), buffers.dst.data(), w, h, colFmt, cfg);
+
+  char reply[64];
+  snprintf(reply, sizeof(reply), "OK %d %d", w * scale, h * scale);
+  return reply;
+}
+
+std::string server::stats(){
+  std::string text = "OK\n";
+  char line[128];
+  {
+    std::lock_guard<std::mutex> lock(queueLock);
+    snprintf(line, sizeof(line), "queued %zu\n", queue.size());
+    text += line;
+  }
+  snprintf(line, sizeof(line), "running %d\ndone %llu\nfailed %llu\n", running.load(),
+           (unsigned long long)jobsDone.load(), (unsigned long long)jobsFailed.load());
+  text += line;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    if (i < LATENCY_BUCKETS - 1)
+      snprintf(line, sizeof(line), "latency_ms_below_%d %llu\n", 1 << i, (unsigned long long)latency[i].load());
+    else
+      snprintf(line, sizeof(line), "latency_ms_above_%d %llu\n", 1 << (i - 1), (unsigned long long)latency[i].load());
+    text += line;
+  }
+  text.erase(text.size() - 1); //the caller ends the reply
+  return text;
+}
+
+void server::handle(int fd, Buffers& buffers){
+  std::string header;
+  std::string reply;
+  bool pixels = false;
+  if (!readLine(fd, header, Clock::now() + std::chrono::seconds(IO_TIMEOUT_SECONDS))) {
+    reply = timedOut() ? "ERROR timeout" : "ERROR no request";
+  } else {
+    const std::vector<std::string> fields = splitFields(header);
+    try {
+      if (fields[0] == "FILE")
+        reply = scaleFile(fields);
+      else if (fields[0] == "PIXELS") {
+        reply = scalePixels(fd, fields, buffers);
+        pixels = reply.compare(0, 3, "OK ") == 0;
+      }
+      else if (fields[0] == "STATS")
+        reply = stats();
+      else
+        reply = "ERROR unknown request '" + fields[0] + "'";
+    } catch (const std::bad_alloc&) {
+      //e.g. in SDL_image's or xBRZ's own buffers: fails the job, not the server
+      reply = "ERROR out of memory";
+    }
+  }
+  reply += '\n';
+  bool ok = writeAll(fd, reply.data(), reply.size());
+  if (pixels)
+    ok = ok && writeAll(fd, buffers.dst.data(), buffers.dst.size() * sizeof(uint32_t));
+  if (!ok || reply.compare(0, 2, "OK") != 0)
+    jobsFailed++;
+}
+
+void server::worker(){
+  //one job per worker: its scale calls stay on this thread instead of starting a thread per CPU each
+  libxbrzscale::setThreadLimit(1);
+  Buffers buffers;
+  for (;;) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(queueLock);
+      queueChanged.wait(lock, [] { return stopping || !queue.empty(); });
+      if (queue.empty())
+        return;
+      job = queue.front();
+      queue.pop_front();
+    }
+    running++;
+    handle(job.fd, buffers);
+    close(job.fd);
+    running--;
+    jobsDone++;
+
+    //time since the connection was accepted, including the wait in the queue
+    const double ms = std::chrono::duration<double, std::milli>(Clock::now() - job.received).count();
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && ms >= double(1 << bucket))
+      bucket++;
+    latency[bucket]++;
+  }
+}
+
+int server::serve(const char* socketPath, size_t maxPixels){
+  maxJobPixels = maxPixels;
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: '%s'\n", socketPath);
+    return 1;
+  }
+  strcpy(addr.sun_path, socketPath);
+
+  //a socket file nobody listens on is left over from a server that did not shut down cleanly
+  const int other = connectTo(socketPath);
+  if (other >= 0) {
+    close(other);
+    fprintf(stderr, "Another server is already listening on '%s'\n", socketPath);
+    return 1;
+  }
+  unlink(socketPath);
+
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0) {
+    fprintf(stderr, "Failed to listen on '%s': %s\n", socketPath, strerror(errno));
+    if (listener >= 0)
+      close(listener);
+    return 1;
+  }
+
+  //the accept loop polls the read end; a signal that comes before the poll() leaves its byte in the pipe and is not lost
+  if (pipe(stopPipe) != 0) {
+    fprintf(stderr, "Failed to create a pipe: %s\n", strerror(errno));
+    close(listener);
+    return 1;
+  }
+  fcntl(stopPipe[1], F_SETFL, fcntl(stopPipe[1], F_GETFL) | O_NONBLOCK); //the signal handler must never block
+  //only accept() connections poll() has seen: one that is gone by then returns EAGAIN instead of blocking
+  fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+  struct sigaction stop = {};
+  stop.sa_handler = onStopSignal;
+  sigaction(SIGINT, &stop, NULL);
+  sigaction(SIGTERM, &stop, NULL);
+  signal(SIGPIPE, SIG_IGN); //a client that disconnects early must not end the server
+
+  //create xBRZ's distance table now instead of during the first job
+  const uint32_t warmup[4] = { 0xff000000, 0xffffffff, 0xffffffff, 0xff000000 };
+  uint32_t warmupScaled[4 * 2 * 2];
+  xbrz::scale(2, warmup, warmupScaled, 2, 2, xbrz::ColorFormat::ARGB);
+
+  //the workers inherit a mask with SIGINT/SIGTERM blocked: the signals go to this thread instead of interrupting a job
+  sigset_t stopSignals, oldMask;
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGINT);
+  sigaddset(&stopSignals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stopSignals, &oldMask);
+  const int threads = libxbrzscale::getThreadCount();
+  std::vector<std::thread> pool;
+  for (int t = 0; t < threads; t++)
+    pool.emplace_back(worker);
+  pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+  printf("Listening on '%s' with %d worker threads\n", socketPath, threads);
+  fflush(stdout);
+
+  const timeval timeout = { IO_TIMEOUT_SECONDS, 0 };
+  for (;;) {
+    pollfd fds[2] = { { stopPipe[0], POLLIN, 0 }, { listener, POLLIN, 0 } };
+    if (poll(fds, 2, -1) < 0)
+      continue; //EINTR: the signal's byte is in the pipe
+    if (fds[0].revents)
+      break;
+    const int fd = accept(listener, NULL, NULL);
+    if (fd < 0)
+      continue;
+    //some systems pass O_NONBLOCK on from the listening socket; the workers block, up to the timeouts
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    std::lock_guard<std::mutex> lock(queueLock);
+    queue.push_back(Job{ fd, Clock::now() });
+    queueChanged.notify_one();
+  }
+
+  //jobs already accepted are finished, each within the timeouts
+  close(listener);
+  unlink(socketPath);
+  {
+    std::lock_guard<std::mutex> lock(queueLock);
+    stopping = true;
+    queueChanged.notify_all();
+  }
+  for (std::thread& t : pool)
+    t.join();
+  printf("Served %llu jobs (%llu failed)\n", (unsigned long long)jobsDone.load(), (unsigned long long)jobsFailed.load());
+  return 0;
+}
+
+int server::client(const char* socketPath, int argc, char** argv){
+  std::string request;
+  if (argc == 1 && strcmp(argv[0], "stats") == 0)
+    request = "STATS\n";
+  else if (argc == 3)
+    request = std::string("FILE\t") + argv[0] + "\t" + absolutePath(argv[1]) + "\t" + absolutePath(argv[2]) + "\n"; //the server has its own working directory
+  else {
+    fprintf(stderr, "usage: xbrzscale --client SOCKET scale_factor input_image output_image\n"
+                    "       xbrzscale --client SOCKET stats\n");
+    return 1;
+  }
+
+  const int fd = connectTo(socketPath);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to connect to '%s': %s\n", socketPath, strerror(errno));
+    return 1;
+  }
+  std::string reply;
+  bool ok = writeAll(fd, request.data(), request.size());
+  char buf[4096];
+  ssize_t n;
+  while (ok && (n = read(fd, buf, sizeof(buf))) > 0)
+    reply.append(buf, n);
+  close(fd);
+
+  if (!ok || reply.empty()) {
+    fprintf(stderr, "No reply from '%s'\n", socketPath);
+    return 1;
+  }
+  const bool success = reply.compare(0, 2, "OK") == 0;
+  fputs(reply.c_str(), success ? stdout : stderr);
+  return success ? 0 : 1;
+}
+
+#endif
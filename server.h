@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2014 Przemysław Grzywacz <nexather@gmail.com>
+ * This file is part of xbrzscale.
+ *
+ * xbrzscale is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * xbrzscale --serve: a long-running process that scales images for clients on the same machine via a Unix domain socket, so that process
+ * start, SDL_Init() and the creation of xBRZ's distance table are paid once instead of per image. Jobs run on a pool of worker threads,
+ * one job per thread, each scaled on its worker alone. A job whose scaled image would exceed the pixel limit is refused before its
+ * buffers are allocated.
+ *
+ * One request per connection: a header line of tab-separated fields, optionally followed by pixels. The reply is a line "OK ..." or
+ * "ERROR <message>", optionally followed by pixels; the server closes the connection after it.
+ *  FILE <factor> <input> <output>                     scales an image file to a PNG, paths as seen by the server
+ *                                                     -> OK <milliseconds>
+ *  PIXELS <factor> <w> <h> [<format> [<name>=<value>...]]
+ *                                                     followed by w * h ARGB pixels, native-endian uint32_t
+ *                                                     format: auto (default), rgb, argb, argb_unbuffered, argb_opaque, argb_fixed, argb_ycbcr
+ *                                                     names: the members of xbrz::ScalerCfg, e.g. equalColorTolerance=20 or memoizeBlocks=1
+ *                                                     -> OK <w * factor> <h * factor>, followed by the scaled pixels
+ *  STATS                                              -> OK, followed by "name value" lines: queue depth, job counts, latency histogram
+ */
+class server
+{
+ public:
+  // runs until SIGINT or SIGTERM, refusing jobs whose scaled image has more than maxPixels pixels; returns the exit code
+  static int serve(const char* socketPath, size_t maxPixels);
+  // client side for scripts: "scale_factor input_image output_image" or "stats"; prints the reply, returns the exit code
+  static int client(const char* socketPath, int argc, char** argv);
+ private:
+  struct Buffers;
+  static void worker();
+  static void handle(int fd, Buffers& buffers);
+  static std::string scaleFile(const std::vector<std::string>& fields);
+  static std::string scalePixels(int fd, const std::vector<std::string>& fields, Buffers& buffers);
+  static std::string stats();
+};
+
+#endif
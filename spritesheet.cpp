@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2014 Przemysław Grzywacz <nexather@gmail.com>
+ * This file is part of xbrzscale.
+ *
+ * xbrzscale is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spritesheet.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+bool readFile(const char* file, std::string& text){
+  FILE* f = fopen(file, "rb");
+  if (!f) return false;
+
+  char buf[4096];
+  size_t n;
+  text.clear();
+  while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    text.append(buf, n);
+
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+bool writeFile(const char* file, const std::string& text){
+  FILE* f = fopen(file, "wb");
+  if (!f) return false;
+
+  bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+  ok = fclose(f) == 0 && ok;
+  return ok;
+}
+
+std::string scaleNumber(const std::string& number, int scale){
+  char* end = NULL;
+  double value = strtod(number.c_str(), &end);
+  if (end == number.c_str() || *end != '\0')
+    return number;
+
+  char buf[64];
+  value *= scale;
+  if (value == std::floor(value) && std::fabs(value) < 1e15)
+    snprintf(buf, sizeof(buf), "%.0f", value);
+  else
+    snprintf(buf, sizeof(buf), "%g", value);
+  return buf;
+}
+
+bool isOneOf(const std::string& s, const char* const* list){
+  for (; *list; list++)
+    if (s == *list) return true;
+  return false;
+}
+
+std::string jsonEscape(const std::string& s){
+  std::string out;
+  for (char c : s) {
+    if (c == '"' || c == '\\') out += '\\';
+    out += c;
+  }
+  return out;
+}
+
+std::string xmlEscape(const std::string& s){
+  std::string out;
+  for (char c : s) {
+    switch (c) {
+    case '&': out += "&amp;"; break;
+    case '<': out += "&lt;"; break;
+    case '>': out += "&gt;"; break;
+    case '"': out += "&quot;"; break;
+    default: out += c;
+    }
+  }
+  return out;
+}
+
+/* JSON nesting level: an object or array, and the key it was found under */
+struct JsonScope
+{
+  bool isObject;
+  std::string key;        // key of this scope in the enclosing object, empty inside arrays
+  std::string pendingKey; // objects: key of the value being read, empty while expecting a key
+
+  // "frame" objects
+  int frame[4];
+  unsigned frameFound;
+
+  // sprite objects (the ones containing a "frame")
+  int rectIndex;
+  std::string filename;
+  bool rotated;
+};
+
+const char* const JSON_RECT_OBJECTS[] = { "frame", "spriteSourceSize", "sourceSize", "size", NULL };
+const char* const JSON_RECT_KEYS[] = { "x", "y", "w", "h", NULL };
+
+}
+
+bool spritesheet::load(const char* file, std::vector<SpriteRect>& rects){
+  std::string text, scaledText;
+  if (!readFile(file, text)) {
+    fprintf(stderr, "Failed to read sprite sheet '%s'\n", file);
+    return false;
+  }
+  return parse(text, 1, "", rects, scaledText);
+}
+
+bool spritesheet::saveScaled(const char* in_file, const char* out_file, int scale, const std::string& imageName){
+  std::string text, scaledText;
+  std::vector<SpriteRect> rects;
+  if (!readFile(in_file, text)) {
+    fprintf(stderr, "Failed to read sprite sheet '%s'\n", in_file);
+    return false;
+  }
+  if (!parse(text, scale, imageName, rects, scaledText))
+    return false;
+  if (!writeFile(out_file, scaledText)) {
+    fprintf(stderr, "Failed to write sprite sheet '%s'\n", out_file);
+    return false;
+  }
+  return true;
+}
+
+bool spritesheet::parse(const std::string& text, int scale, const std::string& imageName, std::vector<SpriteRect>& rects, std::string& scaledText){
+  rects.clear();
+  scaledText.clear();
+
+  size_t i = 0;
+  while (i < text.size() && isspace(static_cast<unsigned char>(text[i])))
+    i++;
+
+  if (i < text.size() && text[i] == '<')
+    return parseXml(text, scale, imageName, rects, scaledText);
+  if (i < text.size() && (text[i] == '{' || text[i] == '['))
+    return parseJson(text, scale, imageName, rects, scaledText);
+
+  fprintf(stderr, "Unknown sprite sheet format, expected JSON or XML\n");
+  return false;
+}
+
+bool spritesheet::parseJson(const std::string& text, int scale, const std::string& imageName, std::vector<SpriteRect>& rects, std::string& scaledText){
+  std::vector<JsonScope> stack;
+  size_t i = 0;
+  const size_t n = text.size();
+
+  auto pushScope = [&](bool isObject) {
+    JsonScope scope = JsonScope();
+    scope.isObject = isObject;
+    scope.rectIndex = -1;
+    if (!stack.empty())
+      scope.key = stack.back().pendingKey;
+    stack.push_back(scope);
+  };
+
+  while (i < n) {
+    const char c = text[i];
+
+    if (isspace(static_cast<unsigned char>(c)) || c == ':') {
+      scaledText += c;
+      i++;
+    } else if (c == '{' || c == '[') {
+      pushScope(c == '{');
+      scaledText += c;
+      i++;
+    } else if (c == '}' || c == ']') {
+      if (stack.empty() || stack.back().isObject != (c == '}')) {
+        fprintf(stderr, "Malformed JSON sprite sheet at offset %zu\n", i);
+        return false;
+      }
+      JsonScope scope = stack.back();
+      stack.pop_back();
+
+      if (scope.isObject && scope.key == "frame" && scope.frameFound == 0xf && !stack.empty()) {
+        SpriteRect rect;
+        rect.x = scope.frame[0];
+        rect.y = scope.frame[1];
+        rect.w = scope.frame[2];
+        rect.h = scope.frame[3];
+        stack.back().rectIndex = rects.size();
+        rects.push_back(rect);
+      }
+      if (scope.rectIndex >= 0) {
+        SpriteRect& rect = rects[scope.rectIndex];
+        rect.name = !scope.filename.empty() ? scope.filename : scope.key;
+        if (scope.rotated) // stored rotated by 90 degrees: "frame" holds the unrotated size
+          std::swap(rect.w, rect.h);
+      }
+      if (!stack.empty())
+        stack.back().pendingKey.clear();
+
+      scaledText += c;
+      i++;
+    } else if (c == ',') {
+      if (!stack.empty())
+        stack.back().pendingKey.clear();
+      scaledText += c;
+      i++;
+    } else if (c == '"') {
+      size_t end = i + 1;
+      std::string value;
+      while (end < n && text[end] != '"') {
+        if (text[end] == '\\' && end + 1 < n)
+          end++;
+        value += text[end];
+        end++;
+      }
+      if (end >= n) {
+        fprintf(stderr, "Malformed JSON sprite sheet: unterminated string\n");
+        return false;
+      }
+      end++;
+
+      size_t next = end;
+      while (next < n && isspace(static_cast<unsigned char>(text[next])))
+        next++;
+
+      JsonScope* scope = stack.empty() ? NULL : &stack.back();
+      if (scope && scope->isObject && scope->pendingKey.empty() && next < n && text[next] == ':') {
+        scope->pendingKey = value;
+        scaledText.append(text, i, end - i);
+      } else if (scope && scope->isObject && scope->pendingKey == "image" && !imageName.empty()) {
+        scaledText += "\"" + jsonEscape(imageName) + "\"";
+      } else if (scope && scope->isObject && scope->pendingKey == "scale" && scope->key == "meta" && scale != 1) {
+        scaledText += "\"" + scaleNumber(value, scale) + "\"";
+      } else {
+        if (scope && scope->isObject && scope->pendingKey == "filename")
+          scope->filename = value;
+        scaledText.append(text, i, end - i);
+      }
+      i = end;
+    } else if (c == '-' || c == '+' || c == '.' || isdigit(static_cast<unsigned char>(c))) {
+      size_t end = i;
+      while (end < n && text[end] && (strchr("+-.eE", text[end]) || isdigit(static_cast<unsigned char>(text[end]))))
+        end++;
+      const std::string number = text.substr(i, end - i);
+
+      JsonScope* scope = stack.empty() ? NULL : &stack.back();
+      if (scope && scope->isObject && isOneOf(scope->key, JSON_RECT_OBJECTS) && isOneOf(scope->pendingKey, JSON_RECT_KEYS)) {
+        if (scope->key == "frame") {
+          static const char* const FIELDS = "xywh";
+          const int field = strchr(FIELDS, scope->pendingKey[0]) - FIELDS;
+          scope->frame[field] = atoi(number.c_str());
+          scope->frameFound |= 1u << field;
+        }
+        scaledText += scaleNumber(number, scale);
+      } else {
+        scaledText += number;
+      }
+      i = end;
+    } else if (isalpha(static_cast<unsigned char>(c))) {
+      size_t end = i;
+      while (end < n && isalpha(static_cast<unsigned char>(text[end])))
+        end++;
+      if (!stack.empty() && stack.back().isObject && stack.back().pendingKey == "rotated")
+        stack.back().rotated = text.compare(i, end - i, "true") == 0;
+      scaledText.append(text, i, end - i);
+      i = end;
+    } else {
+      fprintf(stderr, "Malformed JSON sprite sheet at offset %zu\n", i);
+      return false;
+    }
+  }
+
+  if (!stack.empty()) {
+    fprintf(stderr, "Malformed JSON sprite sheet: unexpected end of file\n");
+    return false;
+  }
+  return true;
+}
+
+bool spritesheet::parseXml(const std::string& text, int scale, const std::string& imageName, std::vector<SpriteRect>& rects, std::string& scaledText){
+  static const char* const SCALED_ATTRIBUTES[] = {
+    "x", "y", "width", "height", "frameX", "frameY", "frameWidth", "frameHeight", // Starling/Sparrow
+    "w", "h", "oX", "oY", "oW", "oH",                                              // TexturePacker generic XML
+    NULL
+  };
+  static const char* const IMAGE_ATTRIBUTES[] = { "imagePath", NULL };
+
+  size_t i = 0;
+  const size_t n = text.size();
+
+  while (i < n) {
+    size_t tagStart = text.find('<', i);
+    if (tagStart == std::string::npos) {
+      scaledText.append(text, i, std::string::npos);
+      break;
+    }
+    scaledText.append(text, i, tagStart - i);
+    i = tagStart;
+
+    // comments, declarations and closing tags are copied verbatim
+    if (text.compare(i, 4, "<!--") == 0) {
+      size_t end = text.find("-->", i);
+      end = end == std::string::npos ? n : end + 3;
+      scaledText.append(text, i, end - i);
+      i = end;
+      continue;
+    }
+    if (i + 1 < n && (text[i + 1] == '?' || text[i + 1] == '!' || text[i + 1] == '/')) {
+      size_t end = text.find('>', i);
+      end = end == std::string::npos ? n : end + 1;
+      scaledText.append(text, i, end - i);
+      i = end;
+      continue;
+    }
+
+    size_t nameEnd = i + 1;
+    while (nameEnd < n && !isspace(static_cast<unsigned char>(text[nameEnd])) && text[nameEnd] != '>' && text[nameEnd] != '/')
+      nameEnd++;
+    const std::string tag = text.substr(i + 1, nameEnd - i - 1);
+    scaledText.append(text, i, nameEnd - i);
+    i = nameEnd;
+
+    SpriteRect rect = SpriteRect();
+    unsigned found = 0;
+
+    while (i < n && text[i] != '>') {
+      if (isspace(static_cast<unsigned char>(text[i])) || text[i] == '/') {
+        scaledText += text[i++];
+        continue;
+      }
+
+      size_t attrEnd = i;
+      while (attrEnd < n && text[attrEnd] != '=' && text[attrEnd] != '>' && !isspace(static_cast<unsigned char>(text[attrEnd])))
+        attrEnd++;
+      const std::string attr = text.substr(i, attrEnd - i);
+      size_t eq = attrEnd;
+      while (eq < n && isspace(static_cast<unsigned char>(text[eq])))
+        eq++;
+      if (eq >= n || text[eq] != '=') { // attribute without value
+        scaledText.append(text, i, attrEnd - i);
+        i = attrEnd;
+        continue;
+      }
+      size_t quote = eq + 1;
+      while (quote < n && isspace(static_cast<unsigned char>(text[quote])))
+        quote++;
+      if (quote >= n || (text[quote] != '"' && text[quote] != '\'')) {
+        fprintf(stderr, "Malformed XML sprite sheet at offset %zu\n", quote);
+        return false;
+      }
+      size_t valueEnd = text.find(text[quote], quote + 1);
+      if (valueEnd == std::string::npos) {
+        fprintf(stderr, "Malformed XML sprite sheet: unterminated attribute\n");
+        return false;
+      }
+      const std::string value = text.substr(quote + 1, valueEnd - quote - 1);
+
+      scaledText.append(text, i, quote + 1 - i);
+      if (isOneOf(attr, SCALED_ATTRIBUTES))
+        scaledText += scaleNumber(value, scale);
+      else if (isOneOf(attr, IMAGE_ATTRIBUTES) && !imageName.empty())
+        scaledText += xmlEscape(imageName);
+      else
+        scaledText += value;
+      scaledText += text[valueEnd];
+      i = valueEnd + 1;
+
+      if (attr == "x") { rect.x = atoi(value.c_str()); found |= 1; }
+      else if (attr == "y") { rect.y = atoi(value.c_str()); found |= 2; }
+      else if (attr == "width" || attr == "w") { rect.w = atoi(value.c_str()); found |= 4; }
+      else if (attr == "height" || attr == "h") { rect.h = atoi(value.c_str()); found |= 8; }
+      else if (attr == "name" || attr == "n") rect.name = value;
+    }
+
+    if ((tag == "SubTexture" || tag == "sprite") && found == 0xf)
+      rects.push_back(rect);
+
+    if (i < n) // '>'
+      scaledText += text[i++];
+  }
+
+  return true;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2014 Przemysław Grzywacz <nexather@gmail.com>
+ * This file is part of xbrzscale.
+ *
+ * xbrzscale is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+
+/*
+ * Sprite rectangles of a texture atlas, read from the sidecar file written by the atlas packer.
+ *
+ * Supported sidecars:
+ *  - JSON in TexturePacker style, "hash" or "array" flavour: "frame": {"x", "y", "w", "h"} per sprite
+ *  - XML in Starling/Sparrow style (<SubTexture x y width height>) or TexturePacker generic XML (<sprite x y w h>)
+ *
+ * The sidecar is rewritten as-is, except that all coordinates are multiplied by the scale factor and the atlas
+ * image reference points to the scaled image.
+ */
+struct SpriteRect
+{
+  std::string name;
+  int x, y, w, h; // area covered in the atlas image
+};
+
+class spritesheet
+{
+ public:
+  static bool load(const char* file, std::vector<SpriteRect>& rects);
+  static bool saveScaled(const char* in_file, const char* out_file, int scale, const std::string& imageName);
+  static bool parse(const std::string& text, int scale, const std::string& imageName, std::vector<SpriteRect>& rects, std::string& scaledText);
+ private:
+  static bool parseJson(const std::string& text, int scale, const std::string& imageName, std::vector<SpriteRect>& rects, std::string& scaledText);
+  static bool parseXml(const std::string& text, int scale, const std::string& imageName, std::vector<SpriteRect>& rects, std::string& scaledText);
+};
@@ -45,6 +45,9 @@ enum class ColorFormat //from high bits -> low bits, 8 bit per channel
     RGB,  //8 bit for each red, green, blue, upper 8 bits unused
     ARGB, //including alpha channel, BGRA byte order on little-endian machines
     ARGB_UNBUFFERED, //like ARGB, but without the one-time buffer creation overhead (ca. 100 - 300 ms) at the expense of a slightly slower scaling time
+    ARGB_OPAQUE, //same result as ARGB, but faster for images where (nearly) all pixels have alpha 255; slower for images with lots of transparency
+    ARGB_FIXED, //like ARGB, but distances and thresholds in fixed-point integers: 32 MB buffer instead of 64 MB; rounding flips a few blend decisions
+    ARGB_YCBCR, //like ARGB, but without distance buffer: pixels are converted to YCbCr once as they enter the kernel; more exact, so a few blend decisions differ
 };
 
 const int SCALE_FACTOR_MAX = 6;
@@ -65,6 +68,63 @@ void scale(size_t factor, //valid range: 2 - SCALE_FACTOR_MAX
            const ScalerCfg& cfg = ScalerCfg(),
            int yFirst = 0, int yLast = std::numeric_limits<int>::max()); //slice of source image
 
+/*
+-> like scale(), but for the rectangle [xFirst, xLast) x [yFirst, yLast) of the source only: e.g. the visible part of a zoomed image, or one tile of a huge one
+-> the target rectangle [scale * xFirst, scale * xLast) x [scale * yFirst, scale * yLast) is the same as after scaling the whole image; the source is read
+   up to 2 pixels beyond the rectangle on each side, the rest of the target is not touched
+THREAD-SAFETY: non-overlapping rectangles of the same image may be scaled in parallel; like for slices, avoid very small rectangles (e.g. less than 16 x 16)
+*/
+void scale(size_t factor, //valid range: 2 - SCALE_FACTOR_MAX
+           const uint32_t* src, uint32_t* trg, int srcWidth, int srcHeight,
+           ColorFormat colFmt,
+           const ScalerCfg& cfg,
+           int xFirst, int xLast, int yFirst, int yLast); //rectangle of source image
+
+/*
+-> false if the target image would be too large to address: its row size in bytes and its height must fit into an int, and its total size into
+   the address space; check this before allocating the target buffer, scale() and scaleSkipTransparent() refuse such images
+*/
+bool canScale(size_t factor, int srcWidth, int srcHeight);
+
+/*
+-> like scale(), but runs the xBRZ kernel only on the bounding boxes (per band of rows) of non-transparent content, including the 2 pixels of context
+   around it; fully transparent areas are copied from the source => same result as scale(), but effort scales with the visible pixels instead of the canvas
+-> meant for sprites with lots of transparent padding; for ColorFormat::RGB this is the same as scale()
+*/
+void scaleSkipTransparent(size_t factor, //valid range: 2 - SCALE_FACTOR_MAX
+                          const uint32_t* src, uint32_t* trg, int srcWidth, int srcHeight,
+                          ColorFormat colFmt,
+                          const ScalerCfg& cfg = ScalerCfg());
+
+/*
+-> scale() in two steps, for rendering the same image at several scale factors: the analysis that decides which corners to blend does not depend on
+   the factor, so computeBlendMap() runs it once and scaleWithBlendMap() renders any factor from its result; same output as scale()
+-> "blendMap" holds srcWidth * srcHeight bytes; it must be complete for rows [yFirst, yLast) before these are rendered
+THREAD-SAFETY: like scale(), both may run on non-overlapping [yFirst, yLast) ranges in parallel; renderings of different factors may run in parallel, too
+*/
+void computeBlendMap(const uint32_t* src, unsigned char* blendMap, int srcWidth, int srcHeight,
+                     ColorFormat colFmt,
+                     const ScalerCfg& cfg = ScalerCfg(),
+                     int yFirst = 0, int yLast = std::numeric_limits<int>::max());
+
+void scaleWithBlendMap(size_t factor, //valid range: 2 - SCALE_FACTOR_MAX
+                       const uint32_t* src, const unsigned char* blendMap, uint32_t* trg, int srcWidth, int srcHeight,
+                       ColorFormat colFmt, //same as for computeBlendMap()
+                       const ScalerCfg& cfg = ScalerCfg(),
+                       int yFirst = 0, int yLast = std::numeric_limits<int>::max());
+
+/*
+-> like scale(), but on two threads: a second thread runs the analysis of computeBlendMap() a few rows ahead, while the calling one renders the rows
+   it has finished => lower latency for a single image without splitting it into slices, which analyzes the first row of each slice twice; same output
+-> falls back to scale() if no thread can be started
+-> an exception on either thread (e.g. std::bad_alloc) stops both and reaches the caller once the second thread is joined
+*/
+void scalePipelined(size_t factor, //valid range: 2 - SCALE_FACTOR_MAX
+                    const uint32_t* src, uint32_t* trg, int srcWidth, int srcHeight,
+                    ColorFormat colFmt,
+                    const ScalerCfg& cfg = ScalerCfg(),
+                    int yFirst = 0, int yLast = std::numeric_limits<int>::max());
+
 void bilinearScale(const uint32_t* src, int srcWidth, int srcHeight,
                    /**/  uint32_t* trg, int trgWidth, int trgHeight);
 
@@ -72,6 +132,42 @@ void nearestNeighborScale(const uint32_t* src, int srcWidth, int srcHeight,
                           /**/  uint32_t* trg, int trgWidth, int trgHeight);
 
 
+/*
+-> the color distance buffers (64 MB for ColorFormat::RGB, ARGB and ARGB_OPAQUE, 32 MB for ARGB_FIXED) are allocated on first use; on Linux they are
+   placed on huge pages where possible: explicit ones if reserved (vm.nr_hugepages), else transparent huge pages
+-> size of the buffers allocated so far, how much of it the OS actually backs with huge pages, and how much is mapped from shared memory
+*/
+struct DistanceBufferStats
+{
+    size_t bytes         = 0;
+    size_t hugePageBytes = 0;
+    size_t sharedBytes   = 0;
+};
+DistanceBufferStats getDistanceBufferStats();
+
+/*
+-> opt-in, call before the first scale(): share the color distance buffers with other processes that do the same, via named POSIX shared memory
+   the first process builds a buffer and publishes it; later ones map it read-only after checking its version and checksum => the memory and the
+   creation time are only spent once per user and machine: buffers are only shared between processes of the same user
+-> falls back to a private buffer if there is no shared memory (Windows) or it cannot be used or trusted; shared buffers are not on huge pages
+*/
+void setShareDistanceBuffers(bool enable);
+
+
+/*
+-> ScalerCfg::memoizeBlocks: the output block of a blended pixel only depends on its 3x3 neighborhood and blend info, so each scale() keeps the blocks
+   of recently seen neighborhoods and copies them on a repeat; if fewer than a quarter of 4096 lookups in a row hit, it stops memoizing
+-> statistics over all scale() calls with memoizeBlocks so far: lookups (= blended pixels while enabled), hits, and calls that gave up
+*/
+struct MemoStats
+{
+    uint64_t lookups  = 0;
+    uint64_t hits     = 0;
+    uint64_t bailouts = 0;
+};
+MemoStats getMemoStats();
+
+
 //parameter tuning
 bool equalColorTest(uint32_t col1, uint32_t col2, ColorFormat colFmt, double luminanceWeight, double equalColorTolerance);
 }
@@ -29,6 +29,7 @@ struct ScalerCfg
     double dominantDirectionThreshold = 3.6;
     double steepDirectionThreshold    = 2.2;
     double newTestAttribute           = 0; //unused; test new parameters
+    bool   memoizeBlocks              = false; //reuse output blocks of repeating neighborhoods: faster for pixel art, switches itself off on photos
 };
 }
 
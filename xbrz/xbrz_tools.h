@@ -18,9 +18,16 @@
 #define XBRZ_TOOLS_H_825480175091875
 
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <algorithm>
 #include <type_traits>
 
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+    #define XBRZ_HAVE_SSE2
+    #include <emmintrin.h>
+#endif
+
 
 namespace xbrz
 {
@@ -43,7 +50,7 @@ inline uint16_t rgb888to565(uint32_t pix) { return static_cast<uint16_t>(((pix &
 
 
 template <class Pix> inline
-Pix* byteAdvance(Pix* ptr, int bytes)
+Pix* byteAdvance(Pix* ptr, ptrdiff_t bytes)
 {
     using PixNonConst = typename std::remove_cv<Pix>::type;
     using PixByte     = typename std::conditional<std::is_same<Pix, PixNonConst>::value, char, const char>::type;
@@ -56,7 +63,7 @@ Pix* byteAdvance(Pix* ptr, int bytes)
 
 //fill block  with the given color
 template <class Pix> inline
-void fillBlock(Pix* trg, int pitch /*[bytes]*/, Pix col, int blockWidth, int blockHeight)
+void fillBlock(Pix* trg, ptrdiff_t pitch /*[bytes]*/, Pix col, int blockWidth, int blockHeight)
 {
     //for (int y = 0; y < blockHeight; ++y, trg = byteAdvance(trg, pitch))
     //    std::fill(trg, trg + blockWidth, col);
@@ -91,13 +98,13 @@ void nearestNeighborScale(const PixSrc* src, int srcWidth, int srcHeight, int sr
 
     for (int y = yFirst; y < yLast; ++y)
     {
-        const int ySrc = srcHeight * y / trgHeight;
-        const PixSrc* const srcLine = byteAdvance(src, ySrc * srcPitch);
-        PixTrg*       const trgLine = byteAdvance(trg, y    * trgPitch);
+        const int ySrc = static_cast<int>(static_cast<int64_t>(srcHeight) * y / trgHeight);
+        const PixSrc* const srcLine = byteAdvance(src, static_cast<ptrdiff_t>(ySrc) * srcPitch);
+        PixTrg*       const trgLine = byteAdvance(trg, static_cast<ptrdiff_t>(y)    * trgPitch);
 
         for (int x = 0; x < trgWidth; ++x)
         {
-            const int xSrc = srcWidth * x / trgWidth;
+            const int xSrc = static_cast<int>(static_cast<int64_t>(srcWidth) * x / trgWidth);
             trgLine[x] = pixCvrt(srcLine[xSrc]);
         }
     }
@@ -132,19 +139,19 @@ void nearestNeighborScaleOverSource(const PixSrc* src, int srcWidth, int srcHeig
         // => search for integers in: [ySrc, ySrc + 1) * trgHeight / srcHeight
 
         //keep within for loop to support MT input slices!
-        const int yTrgFirst = ( y      * trgHeight + srcHeight - 1) / srcHeight; //=ceil(y * trgHeight / srcHeight)
-        const int yTrgLast  = ((y + 1) * trgHeight + srcHeight - 1) / srcHeight; //=ceil(((y + 1) * trgHeight) / srcHeight)
+        const int yTrgFirst = static_cast<int>(( static_cast<int64_t>(y)      * trgHeight + srcHeight - 1) / srcHeight); //=ceil(y * trgHeight / srcHeight)
+        const int yTrgLast  = static_cast<int>(((static_cast<int64_t>(y) + 1) * trgHeight + srcHeight - 1) / srcHeight); //=ceil(((y + 1) * trgHeight) / srcHeight)
         const int blockHeight = yTrgLast - yTrgFirst;
 
         if (blockHeight > 0)
         {
-            const PixSrc* srcLine = byteAdvance(src, y         * srcPitch);
-            /**/  PixTrg* trgLine = byteAdvance(trg, yTrgFirst * trgPitch);
+            const PixSrc* srcLine = byteAdvance(src, static_cast<ptrdiff_t>(y)         * srcPitch);
+            /**/  PixTrg* trgLine = byteAdvance(trg, static_cast<ptrdiff_t>(yTrgFirst) * trgPitch);
             int xTrgFirst = 0;
 
             for (int x = 0; x < srcWidth; ++x)
             {
-                const int xTrgLast = ((x + 1) * trgWidth + srcWidth - 1) / srcWidth;
+                const int xTrgLast = static_cast<int>(((static_cast<int64_t>(x) + 1) * trgWidth + srcWidth - 1) / srcWidth);
                 const int blockWidth = xTrgLast - xTrgFirst;
                 if (blockWidth > 0)
                 {
@@ -195,7 +202,7 @@ void bilinearScale(const uint32_t* src, int srcWidth, int srcHeight, int srcPitc
     std::vector<CoeffsX> buf(trgWidth);
     for (int x = 0; x < trgWidth; ++x)
     {
-        const int x1 = srcWidth * x / trgWidth;
+        const int x1 = static_cast<int>(static_cast<int64_t>(srcWidth) * x / trgWidth);
         int x2 = x1 + 1;
         if (x2 == srcWidth) --x2;
 
@@ -207,16 +214,16 @@ void bilinearScale(const uint32_t* src, int srcWidth, int srcHeight, int srcPitc
 
     for (int y = yFirst; y < yLast; ++y)
     {
-        const int y1 = srcHeight * y / trgHeight;
+        const int y1 = static_cast<int>(static_cast<int64_t>(srcHeight) * y / trgHeight);
         int y2 = y1 + 1;
         if (y2 == srcHeight) --y2;
 
         const double yy1 = y / scaleY - y1;
         const double y2y = 1 - yy1;
 
-        const uint32_t* const srcLine     = byteAdvance(src, y1 * srcPitch);
-        const uint32_t* const srcLineNext = byteAdvance(src, y2 * srcPitch);
-        PixTrg*         const trgLine     = byteAdvance(trg, y  * trgPitch);
+        const uint32_t* const srcLine     = byteAdvance(src, static_cast<ptrdiff_t>(y1) * srcPitch);
+        const uint32_t* const srcLineNext = byteAdvance(src, static_cast<ptrdiff_t>(y2) * srcPitch);
+        PixTrg*         const trgLine     = byteAdvance(trg, static_cast<ptrdiff_t>(y)  * trgPitch);
 
         for (int x = 0; x < trgWidth; ++x)
         {
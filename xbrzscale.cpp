@@ -23,8 +23,17 @@
 #include <SDL2/SDL_surface.h>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
 
+#include "animation.h"
+#include "batch.h"
 #include "libxbrzscale.h"
+#include "pngwriter.h"
+#include "rawstream.h"
+#include "server.h"
+#include "spritesheet.h"
 
 //#include <cstdio>
 //#include <cstdint>
@@ -67,26 +76,251 @@ void displayImage(SDL_Surface* surface, const char* message) {
 }
 */
 
+static void printUsage() {
+	fprintf(stderr, "usage: xbrzscale [options] scale_factor input_image output_image\n");
+	fprintf(stderr, "       xbrzscale [options] --serve SOCKET\n");
+	fprintf(stderr, "       xbrzscale --client SOCKET scale_factor input_image output_image | stats\n");
+	fprintf(stderr, "       xbrzscale [options] --raw WxH|pam scale_factor < input_frames > output_frames\n");
+	fprintf(stderr, "       xbrzscale [options] --batch OUTDIR scale_factor input_image...\n");
+	fprintf(stderr, "scale_factor can be between 2 and 6\n");
+	fprintf(stderr, "a list of scale factors (e.g. 2,3,4) writes one image per factor, named output_image with @2x, @3x, ... before the extension\n");
+	fprintf(stderr, "animated GIF and PNG input is scaled frame by frame and written as animated PNG\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  --skip-transparent  run xBRZ on non-transparent regions only (faster for sprites with lots of padding)\n");
+	fprintf(stderr, "  --threads N         number of worker threads (default: number of CPUs)\n");
+	fprintf(stderr, "  --atlas FILE        input is a texture atlas described by FILE (JSON or XML): scale each sprite separately\n");
+	fprintf(stderr, "  --atlas-out FILE    where to write the scaled atlas description (default: output_image with FILE's extension)\n");
+	fprintf(stderr, "  --detect-upscaled   input that is already a nearest-neighbor upscale is scaled from its native pixels\n");
+	fprintf(stderr, "  --max-memory MB     keep the peak memory usage below MB megabytes (scales in bands, uses fewer threads)\n");
+	fprintf(stderr, "  --huge-pages        put the image buffers on huge pages, too, and report how many were obtained\n");
+	fprintf(stderr, "  --share-table       share xBRZ's distance table with other xbrzscale processes via shared memory\n");
+	fprintf(stderr, "  --memoize           reuse the output of repeating pixel neighbourhoods: faster on pixel art\n");
+	fprintf(stderr, "  --pipeline          analyze and render on two threads at once (single images without --max-memory)\n");
+	fprintf(stderr, "  --serve SOCKET      keep running and scale the images requested on Unix socket SOCKET\n");
+	fprintf(stderr, "  --max-pixels MP     with --serve: refuse requests for scaled images of more than MP megapixels (default 256)\n");
+	fprintf(stderr, "  --client SOCKET     have the server on SOCKET scale the image, or print its statistics\n");
+	fprintf(stderr, "  --raw WxH|pam       scale frames from stdin to stdout: raw BGRA frames of W x H pixels, or PAM images\n");
+	fprintf(stderr, "  --rgba              raw frames are in R, G, B, A byte order\n");
+	fprintf(stderr, "  --batch OUTDIR      scale all input images to OUTDIR/<name>.png, loading, scaling and saving at the same time\n");
+	fprintf(stderr, "  --png-level N       PNG compression level, 0 (none, fastest) to 9 (smallest files); default 6\n");
+	fprintf(stderr, "  --png-filter F      PNG row filter: none, sub, up, average, paeth or adaptive (default: none)\n");
+}
+
+static std::string atlasOutputName(const std::string& out_file, const std::string& atlas_file) {
+	size_t dot = atlas_file.rfind('.');
+	std::string ext = dot != std::string::npos && atlas_file.find_first_of("/\\", dot) == std::string::npos ? atlas_file.substr(dot) : ".json";
+	size_t outDot = out_file.rfind('.');
+	if (outDot != std::string::npos && out_file.find_first_of("/\\", outDot) == std::string::npos)
+		return out_file.substr(0, outDot) + ext;
+	return out_file + ext;
+}
+
+static std::string scaledOutputName(const std::string& out_file, int scale) {
+	char suffix[16];
+	snprintf(suffix, sizeof(suffix), "@%ix", scale);
+	size_t dot = out_file.rfind('.');
+	if (dot != std::string::npos && out_file.find_first_of("/\\", dot) == std::string::npos)
+		return out_file.substr(0, dot) + suffix + out_file.substr(dot);
+	return out_file + suffix;
+}
+
+static std::string baseName(const std::string& path) {
+	size_t slash = path.find_last_of("/\\");
+	return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+static void reportMemory(size_t max_memory) {
+	size_t peak = libxbrzscale::getPeakMemory();
+	printf("Peak memory usage: %zu MB (limit %zu MB)\n", peak >> 20, max_memory >> 20);
+	if (peak > max_memory)
+		fprintf(stderr, "warning: memory limit exceeded\n");
+}
+
 int main(int argc, char* argv[]) {
-	if (argc != 4) {
-		fprintf(stderr, "usage: xbrzscale scale_factor input_image output_image\n");
-		fprintf(stderr, "scale_factor can be between 2 and 6\n");
+	const char* atlas_file = NULL;
+	std::string atlas_out;
+	size_t max_memory = 0;
+	bool detect_upscaled = false;
+	const char* serve_socket = NULL;
+	size_t serve_max_pixels = size_t(256) << 20;
+	const char* raw_spec = NULL;
+	bool raw_rgba = false;
+	const char* batch_dir = NULL;
+	int argi = 1;
+	for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+		bool hasValue = argi + 1 < argc;
+		if (strcmp(argv[argi], "--skip-transparent") == 0) {
+			libxbrzscale::setSkipTransparent(true);
+		} else if (strcmp(argv[argi], "--threads") == 0 && hasValue) {
+			libxbrzscale::setThreadCount(atoi(argv[++argi]));
+		} else if (strcmp(argv[argi], "--atlas") == 0 && hasValue) {
+			atlas_file = argv[++argi];
+		} else if (strcmp(argv[argi], "--atlas-out") == 0 && hasValue) {
+			atlas_out = argv[++argi];
+		} else if (strcmp(argv[argi], "--detect-upscaled") == 0) {
+			libxbrzscale::setDetectUpscaled(true);
+			detect_upscaled = true;
+		} else if (strcmp(argv[argi], "--huge-pages") == 0) {
+			libxbrzscale::setHugePages(true);
+		} else if (strcmp(argv[argi], "--share-table") == 0) {
+			libxbrzscale::setShareDistanceTable(true);
+		} else if (strcmp(argv[argi], "--memoize") == 0) {
+			libxbrzscale::setMemoize(true);
+		} else if (strcmp(argv[argi], "--pipeline") == 0) {
+			libxbrzscale::setPipeline(true);
+		} else if (strcmp(argv[argi], "--serve") == 0 && hasValue) {
+			serve_socket = argv[++argi];
+		} else if (strcmp(argv[argi], "--max-pixels") == 0 && hasValue) {
+			serve_max_pixels = size_t(strtoul(argv[++argi], NULL, 10)) << 20;
+		} else if (strcmp(argv[argi], "--client") == 0 && hasValue) {
+			//the server's options apply
+			return server::client(argv[argi + 1], argc - argi - 2, argv + argi + 2);
+		} else if (strcmp(argv[argi], "--raw") == 0 && hasValue) {
+			raw_spec = argv[++argi];
+		} else if (strcmp(argv[argi], "--rgba") == 0) {
+			raw_rgba = true;
+		} else if (strcmp(argv[argi], "--batch") == 0 && hasValue) {
+			batch_dir = argv[++argi];
+		} else if (strcmp(argv[argi], "--png-level") == 0 && hasValue) {
+			const int level = atoi(argv[++argi]);
+			if (level < 0 || level > 9) {
+				fprintf(stderr, "--png-level must be between 0 and 9, got %i\n", level);
+				return 1;
+			}
+			pngwriter::setCompression(level);
+		} else if (strcmp(argv[argi], "--png-filter") == 0 && hasValue) {
+			static const char* const filters[] = { "none", "sub", "up", "average", "paeth", "adaptive" };
+			int f = 0;
+			while (f < 6 && strcmp(argv[argi + 1], filters[f]) != 0)
+				f++;
+			if (f == 6) {
+				fprintf(stderr, "unknown PNG filter '%s'\n", argv[argi + 1]);
+				return 1;
+			}
+			pngwriter::setFilter(pngwriter::Filter(f));
+			argi++;
+		} else if (strcmp(argv[argi], "--max-memory") == 0 && hasValue) {
+			max_memory = size_t(strtoul(argv[++argi], NULL, 10)) << 20;
+			libxbrzscale::setMaxMemory(max_memory);
+		} else {
+			fprintf(stderr, "unknown option '%s'\n", argv[argi]);
+			printUsage();
+			return 1;
+		}
+	}
+
+	if (serve_socket) {
+		if (argi != argc) {
+			printUsage();
+			return 1;
+		}
+		if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+			fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
+			return 1;
+		}
+		const int ret = server::serve(serve_socket, serve_max_pixels);
+		SDL_Quit();
+		return ret;
+	}
+
+	if (raw_spec) {
+		//no SDL: frames go straight from stdin to xBRZ and back to stdout
+		int w = 0, h = 0;
+		const bool pam = strcmp(raw_spec, "pam") == 0;
+		if (argc - argi != 1 || (!pam && sscanf(raw_spec, "%dx%d", &w, &h) != 2)) {
+			printUsage();
+			return 1;
+		}
+		const int scale = atoi(argv[argi]);
+		if (scale < 2 || scale > 6) {
+			fprintf(stderr, "scale_factor must be between 2 and 6 (inclusive), got %i\n", scale);
+			return 1;
+		}
+		return rawstream::run(pam ? rawstream::PAM : raw_rgba ? rawstream::RGBA : rawstream::BGRA, w, h, scale, stdin, stdout);
+	}
+
+	if (batch_dir) {
+		if (argc - argi < 2) {
+			printUsage();
+			return 1;
+		}
+		const int scale = atoi(argv[argi]);
+		if (scale < 2 || scale > 6) {
+			fprintf(stderr, "scale_factor must be between 2 and 6 (inclusive), got %i\n", scale);
+			return 1;
+		}
+		if (atlas_file || max_memory) {
+			fprintf(stderr, "--batch cannot be combined with --atlas or --max-memory\n");
+			return 1;
+		}
+		if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+			fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
+			return 1;
+		}
+		const int ret = batch::run(scale, batch_dir, argc - argi - 1, argv + argi + 1);
+		SDL_Quit();
+		return ret;
+	}
+
+	if (argc - argi != 3) {
+		printUsage();
 		return 1;
 	}
 	
-	int scale = atoi(argv[1]);
-	char* in_file = argv[2];
-	char* out_file = argv[3];
+	std::vector<int> scales;
+	for (const char* p = argv[argi]; ; p++) {
+		scales.push_back(atoi(p));
+		if (!(p = strchr(p, ',')))
+			break;
+	}
+	int scale = scales[0];
+	char* in_file = argv[argi + 1];
+	char* out_file = argv[argi + 2];
 	
-	if (scale < 2 || scale > 6) {
-		fprintf(stderr, "scale_factor must be between 2 and 6 (inclusive), got %i\n", scale);
+	for (int s : scales) {
+		if (s < 2 || s > 6) {
+			fprintf(stderr, "scale_factor must be between 2 and 6 (inclusive), got %i\n", s);
+			return 1;
+		}
+	}
+	if (scales.size() > 1 && (atlas_file || max_memory || detect_upscaled)) {
+		fprintf(stderr, "several scale factors cannot be combined with --atlas, --max-memory or --detect-upscaled\n");
 		return 1;
 	}
 	
+	std::vector<SDL_Rect> sprites;
+	if (atlas_file) {
+		std::vector<SpriteRect> rects;
+		if (!spritesheet::load(atlas_file, rects))
+			return 1;
+		for (const SpriteRect& r : rects) {
+			SDL_Rect rect = { r.x, r.y, r.w, r.h };
+			sprites.push_back(rect);
+		}
+		if (atlas_out.empty())
+			atlas_out = atlasOutputName(out_file, atlas_file);
+	}
+
 	if (SDL_Init(SDL_INIT_VIDEO) != 0) {
 		fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
 		return 1;
 	}
+
+	Animation anim;
+	if (!atlas_file && animation::load(in_file, anim)) {
+		if (scales.size() > 1) {
+			fprintf(stderr, "several scale factors are not supported for animations\n");
+			return 1;
+		}
+		Animation scaled;
+		libxbrzscale::setEnableOutput(true);
+		if (!libxbrzscale::scaleAnimation(anim, scale, scaled) || !pngwriter::saveAPNG(out_file, scaled))
+			return 1;
+		if (max_memory)
+			reportMemory(max_memory);
+		SDL_Quit();
+		return 0;
+	}
 	
 	SDL_Surface* src_img = IMG_Load(in_file);
   if (!src_img) {
@@ -97,14 +331,40 @@ int main(int argc, char* argv[]) {
 //  displayImage(src_img, "Source image");
 
   libxbrzscale::setEnableOutput(true);
-	SDL_Surface* dst_img = libxbrzscale::scale(src_img,scale);
-	if(!dst_img)return 1;
+	if (scales.size() > 1) {
+		//the analysis of the source is shared by all factors
+		std::vector<SDL_Surface*> dst_imgs;
+		if (!libxbrzscale::scaleMulti(src_img, scales, dst_imgs))
+			return 1;
+		for (size_t i = 0; i < dst_imgs.size(); i++) {
+			const std::string name = scaledOutputName(out_file, scales[i]);
+			printf("Saving %s...\n", name.c_str());
+			const bool saved = libxbrzscale::savePNG(dst_imgs[i], name.c_str());
+			SDL_FreeSurface(dst_imgs[i]);
+			if (!saved)
+				return 1;
+		}
+	} else if (max_memory && !atlas_file) {
+		//never holds the whole result: streamed to the file band by band if need be
+		if (!libxbrzscale::scaleToPNG(src_img, scale, out_file))
+			return 1;
+	} else {
+		SDL_Surface* dst_img = atlas_file ? libxbrzscale::scaleAtlas(src_img, scale, sprites) : libxbrzscale::scale(src_img,scale);
+		if(!dst_img)return 1;
 
-	//  displayImage(dst_img, "Image after color conversion");
+		//  displayImage(dst_img, "Image after color conversion");
 
-  IMG_SavePNG(dst_img,out_file);
+		const bool saved = libxbrzscale::savePNG(dst_img, out_file);
+		SDL_FreeSurface(dst_img);
+		if (!saved)
+			return 1;
+	}
 
-  SDL_FreeSurface(dst_img);
+	if (max_memory)
+		reportMemory(max_memory);
+
+  if (atlas_file && !spritesheet::saveScaled(atlas_file, atlas_out.c_str(), scale, baseName(out_file)))
+    return 1;
 
   SDL_Quit();
   return 0;